@@ -0,0 +1,490 @@
+/* Program: Constant Database Benchmarks
+ * Author:  Richard James Howe
+ * Email:   howe.r.j.89@gmail.com
+ * License: 0BSD
+ * Repo:    <https://github.com/howerj/cdb>
+ *
+ * Results are printed one per line in a comma separated format so they can
+ * be collected and compared between builds, each line is a single number
+ * named by the benchmark, the dataset (or hash), a parameter and the metric.
+ * Hashing is timed with "clock", which measures processor time, everything
+ * that touches a file is timed with a monotonic wall clock where there is
+ * one. The datasets are made with "cdb_prng" so they are the same each run
+ * for the same seed. */
+#define _POSIX_C_SOURCE 200809L /* for "clock_gettime" */
+#include "cdb.h"
+#include "host.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_KEY_LENGTH (1024ul)
+#define HASH_BYTES     (64ul * 1024ul * 1024ul) /* bytes hashed per measurement */
+#define LOOKUPS        (100000ul) /* lookups timed for each workload */
+#define BENCH_FILE     "bench.cdb"
+#define NELEMS(X)      (sizeof (X) / sizeof ((X)[0]))
+
+typedef struct {
+	const char *name;
+	unsigned long records, key_min, key_max, value_min, value_max; /* lengths are picked uniformly from min to max */
+} dataset_t;
+
+typedef struct {
+	const char *name;
+	unsigned hits; /* percentage of lookups that are for keys in the database */
+	int skew;      /* if set some keys are looked up far more often than others */
+} workload_t;
+
+typedef struct {
+	const char *name;
+	const cdb_options_t *ops;
+} access_t;
+
+typedef struct {
+	cdb_buffer_t *keys, *values;
+	char *arena;
+	size_t count;
+	uint64_t bytes; /* total length of all keys and values */
+} records_t;
+
+static const dataset_t datasets[] = {
+	{ .name = "tiny",   .records = 1000ul,    .key_min = 4, .key_max = 8,  .value_min = 4,   .value_max = 8,    },
+	{ .name = "small",  .records = 100000ul,  .key_min = 8, .key_max = 32, .value_min = 8,   .value_max = 64,   },
+	{ .name = "large",  .records = 1000000ul, .key_min = 8, .key_max = 32, .value_min = 8,   .value_max = 64,   },
+	{ .name = "values", .records = 10000ul,   .key_min = 8, .key_max = 32, .value_min = 256, .value_max = 4096, },
+};
+
+static const workload_t workloads[] = {
+	{ .name = "uniform-100", .hits = 100, .skew = 0, },
+	{ .name = "uniform-50",  .hits = 50,  .skew = 0, },
+	{ .name = "uniform-0",   .hits = 0,   .skew = 0, },
+	{ .name = "skew-100",    .hits = 100, .skew = 1, },
+};
+
+static const access_t modes[] = {
+	{ .name = "file", .ops = &cdb_host_options, },
+	{ .name = "mmap", .ops = &cdb_mmap_options, },
+};
+
+static const char *benchmarks[] = { "hash", "build", "lookup", "iterate", "dump", };
+
+static volatile cdb_word_t sink = 0; /* stops the compiler removing the work being measured */
+
+static double seconds(const clock_t start, const clock_t end) {
+	return (double)(end - start) / (double)CLOCKS_PER_SEC;
+}
+
+static uint64_t now(void) { /* nanoseconds */
+#ifdef CLOCK_MONOTONIC
+	struct timespec t;
+	if (clock_gettime(CLOCK_MONOTONIC, &t) == 0)
+		return ((uint64_t)t.tv_sec * 1000000000ull) + (uint64_t)t.tv_nsec;
+#endif
+	return (uint64_t)((double)clock() * (1e9 / (double)CLOCKS_PER_SEC));
+}
+
+static double rate(const uint64_t amount, const uint64_t ns) {
+	return ns ? (double)amount * 1e9 / (double)ns : 0.0;
+}
+
+static int result(FILE *output, const char *benchmark, const char *name, const char *parameter, const char *metric, const double value) {
+	assert(output);
+	return fprintf(output, "%s,%s,%s,%s,%.0f\n", benchmark, name, parameter, metric, value) < 0 ? -1 : 0;
+}
+
+/* Something is selected if it is named on the command line, or if nothing
+ * of its kind is */
+static int selected(char **names, const int count, const char *name, const char **kind, const size_t kinds) {
+	assert(names);
+	assert(name);
+	int any = 0;
+	for (int i = 0; i < count; i++) {
+		if (!strcmp(names[i], name))
+			return 1;
+		for (size_t j = 0; j < kinds; j++)
+			any |= !strcmp(names[i], kind[j]);
+	}
+	return !any;
+}
+
+static size_t length(uint64_t s[2], const unsigned long min, const unsigned long max) {
+	assert(min <= max);
+	return min + (cdb_prng(s) % (max - min + 1ul));
+}
+
+static void fill(uint64_t s[2], char *buffer, const size_t length) {
+	for (size_t i = 0; i < length; i++)
+		buffer[i] = 'a' + (cdb_prng(s) % 26);
+}
+
+static void records_free(records_t *r) {
+	assert(r);
+	free(r->keys);
+	free(r->values);
+	free(r->arena);
+	memset(r, 0, sizeof (*r));
+}
+
+/* The lengths are picked first so all of the records can go into one block */
+static int records_make(records_t *r, const dataset_t *d, const uint64_t seed) {
+	assert(r);
+	assert(d);
+	memset(r, 0, sizeof (*r));
+	uint64_t s[2] = { seed, 0, };
+	r->count  = d->records;
+	r->keys   = calloc(r->count, sizeof (*r->keys));
+	r->values = calloc(r->count, sizeof (*r->values));
+	if (!r->keys || !r->values)
+		goto fail;
+	for (size_t i = 0; i < r->count; i++) {
+		r->keys[i].length   = length(s, d->key_min, d->key_max);
+		r->values[i].length = length(s, d->value_min, d->value_max);
+		r->bytes += r->keys[i].length + r->values[i].length;
+	}
+	if (!(r->arena = malloc(r->bytes ? r->bytes : 1)))
+		goto fail;
+	char *p = r->arena;
+	for (size_t i = 0; i < r->count; i++) {
+		r->keys[i].buffer = p;
+		fill(s, p, r->keys[i].length);
+		p += r->keys[i].length;
+		r->values[i].buffer = p;
+		fill(s, p, r->values[i].length);
+		p += r->values[i].length;
+	}
+	return 0;
+fail:
+	records_free(r);
+	return -1;
+}
+
+/* Roughly Zipfian: a power of two range is picked uniformly then a key
+ * within it, so the "i"th key is picked with a chance of about 1/i. The
+ * popular keys are then spread out over the file. */
+static size_t pick(uint64_t s[2], const size_t count, const int skew) {
+	assert(count);
+	if (!skew)
+		return cdb_prng(s) % count;
+	unsigned bits = 0;
+	while (bits < 63 && ((uint64_t)1 << bits) < count)
+		bits++;
+	const uint64_t i = cdb_prng(s) % ((uint64_t)1 << (cdb_prng(s) % (bits + 1u)));
+	return (i * UINT64_C(0x9E3779B97F4A7C15)) % count;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int bench_hash(FILE *output, const cdb_hash_info_t *h, const uint8_t *keys) {
+	assert(output);
+	assert(h);
+	assert(keys);
+	static const size_t lengths[] = { 4, 8, 16, 32, 64, 128, 256, 1024, };
+	for (size_t i = 0; i < NELEMS(lengths); i++) {
+		const size_t length = lengths[i], iterations = HASH_BYTES / length;
+		assert(length <= MAX_KEY_LENGTH);
+		cdb_word_t x = 0;
+		const clock_t start = clock();
+		for (size_t j = 0; j < iterations; j++) /* vary the start so the keys differ */
+			x ^= h->hash(keys + (j % MAX_KEY_LENGTH), length);
+		const clock_t end = clock();
+		sink ^= x;
+		const double s = seconds(start, end);
+		char parameter[32];
+		(void)snprintf(parameter, sizeof parameter, "%lu", (unsigned long)length);
+		if (result(output, "hash", h->name, parameter, "bytes-per-second", s > 0 ? (double)HASH_BYTES / s : 0.0) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int bench_build(FILE *output, const dataset_t *d, const records_t *r, const char *file, const int report) {
+	assert(output);
+	assert(d);
+	assert(r);
+	assert(file);
+	cdb_t *cdb = NULL;
+	const uint64_t start = now();
+	if (cdb_open(&cdb, &cdb_host_options, 1, file) < 0)
+		return -1;
+	for (size_t i = 0; i < r->count; i++)
+		if (cdb_add(cdb, &r->keys[i], &r->values[i]) < 0) {
+			(void)cdb_close(cdb);
+			return -1;
+		}
+	if (cdb_close(cdb) < 0)
+		return -1;
+	const uint64_t ns = now() - start;
+	if (!report)
+		return 0;
+	if (result(output, "build", d->name, "file", "records-per-second", rate(r->count, ns)) < 0)
+		return -1;
+	return result(output, "build", d->name, "file", "bytes-per-second", rate(r->bytes, ns));
+}
+
+/* Each lookup is timed on its own, keys that are not in the database are
+ * made by upper casing the first character of one that is. */
+static int bench_lookup(FILE *output, const dataset_t *d, const records_t *r, const access_t *m, const workload_t *w, const char *file, const uint64_t seed) {
+	assert(output);
+	assert(d);
+	assert(r);
+	assert(m);
+	assert(w);
+	assert(file);
+	assert(r->count);
+	uint64_t s[2] = { seed, 1, };
+	cdb_buffer_t *keys = calloc(LOOKUPS, sizeof (*keys));
+	uint64_t *latency = calloc(LOOKUPS, sizeof (*latency));
+	char *missing = malloc(LOOKUPS * (d->key_max + 1ul));
+	cdb_t *cdb = NULL;
+	int rv = -1;
+	if (!keys || !latency || !missing)
+		goto done;
+	for (size_t i = 0; i < LOOKUPS; i++) {
+		keys[i] = r->keys[pick(s, r->count, w->skew)];
+		if ((cdb_prng(s) % 100u) >= w->hits && keys[i].length) {
+			char *k = missing + (i * (d->key_max + 1ul));
+			memcpy(k, keys[i].buffer, keys[i].length);
+			k[0] = 'A' + (k[0] - 'a');
+			keys[i].buffer = k;
+		}
+	}
+	if (cdb_open(&cdb, m->ops, 0, file) < 0)
+		goto done;
+	uint64_t found = 0, total = 0;
+	for (size_t i = 0; i < LOOKUPS; i++) {
+		cdb_file_pos_t value = { 0, 0, };
+		const uint64_t start = now();
+		const int g = cdb_get(cdb, &keys[i], &value);
+		latency[i] = now() - start;
+		if (g < 0)
+			goto done;
+		found += g;
+		total += latency[i];
+		sink ^= value.position;
+	}
+	qsort(latency, LOOKUPS, sizeof (*latency), compare_u64);
+	char parameter[64];
+	(void)snprintf(parameter, sizeof parameter, "%s-%s", m->name, w->name);
+	if (result(output, "lookup", d->name, parameter, "lookups-per-second", rate(LOOKUPS, total)) < 0)
+		goto done;
+	if (result(output, "lookup", d->name, parameter, "p50-ns", latency[(LOOKUPS - 1ul) / 2ul]) < 0)
+		goto done;
+	if (result(output, "lookup", d->name, parameter, "p99-ns", latency[((LOOKUPS - 1ul) * 99ul) / 100ul]) < 0)
+		goto done;
+	if (result(output, "lookup", d->name, parameter, "p999-ns", latency[((LOOKUPS - 1ul) * 999ul) / 1000ul]) < 0)
+		goto done;
+	if (result(output, "lookup", d->name, parameter, "found-percent", (100.0 * found) / LOOKUPS) < 0)
+		goto done;
+	rv = 0;
+done:
+	if (cdb && cdb_close(cdb) < 0)
+		rv = -1;
+	free(keys);
+	free(latency);
+	free(missing);
+	return rv;
+}
+
+static int bench_iterate(FILE *output, const dataset_t *d, const records_t *r, const access_t *m, const char *file) {
+	assert(output);
+	assert(d);
+	assert(r);
+	assert(m);
+	assert(file);
+	cdb_t *cdb = NULL;
+	if (cdb_open(&cdb, m->ops, 0, file) < 0)
+		return -1;
+	const uint64_t start = now();
+	cdb_iter_t it;
+	cdb_file_pos_t key, value;
+	uint64_t count = 0;
+	int g = cdb_iter_init(cdb, &it);
+	while (g >= 0 && (g = cdb_iter_next(cdb, &it, &key, &value)) > 0) {
+		sink ^= key.length ^ value.length;
+		count++;
+	}
+	const uint64_t ns = now() - start;
+	if (cdb_close(cdb) < 0 || g < 0 || count != r->count)
+		return -1;
+	if (result(output, "iterate", d->name, m->name, "records-per-second", rate(count, ns)) < 0)
+		return -1;
+	return result(output, "iterate", d->name, m->name, "bytes-per-second", rate(r->bytes, ns));
+}
+
+typedef struct {
+	char *buffer;
+	size_t length;
+	uint64_t bytes;
+} dump_t;
+
+/* The key and value are read into memory as for a dump, only the writing
+ * out of it is not done */
+static int dump_record(cdb_t *cdb, const cdb_file_pos_t *key, const cdb_file_pos_t *value, void *param) {
+	assert(cdb);
+	assert(key);
+	assert(value);
+	dump_t *d = param;
+	assert(d);
+	if (key->length > d->length || value->length > d->length)
+		return -1;
+	if (cdb_seek(cdb, key->position) < 0 || cdb_read(cdb, d->buffer, key->length) < 0)
+		return -1;
+	sink ^= key->length ? d->buffer[0] : 0;
+	if (cdb_seek(cdb, value->position) < 0 || cdb_read(cdb, d->buffer, value->length) < 0)
+		return -1;
+	sink ^= value->length ? d->buffer[0] : 0;
+	char header[64];
+	const int l = snprintf(header, sizeof header, "+%lu,%lu:", (unsigned long)key->length, (unsigned long)value->length);
+	d->bytes += (uint64_t)l + key->length + value->length + 3u; /* "->" and a new line */
+	return 0;
+}
+
+static int bench_dump(FILE *output, const dataset_t *d, const access_t *m, const char *file) {
+	assert(output);
+	assert(d);
+	assert(m);
+	assert(file);
+	dump_t p = { .length = d->key_max > d->value_max ? d->key_max : d->value_max, };
+	if (!(p.buffer = malloc(p.length + 1ul)))
+		return -1;
+	cdb_t *cdb = NULL;
+	int r = -1;
+	if (cdb_open(&cdb, m->ops, 0, file) < 0)
+		goto done;
+	const uint64_t start = now();
+	if (cdb_foreach(cdb, dump_record, &p) < 0)
+		goto done;
+	const uint64_t ns = now() - start;
+	r = result(output, "dump", d->name, m->name, "bytes-per-second", rate(p.bytes, ns));
+done:
+	if (cdb && cdb_close(cdb) < 0)
+		r = -1;
+	free(p.buffer);
+	return r;
+}
+
+static int bench_dataset(FILE *output, const dataset_t *d, char **names, const int count, const char *file, const uint64_t seed) {
+	assert(output);
+	assert(d);
+	const char *workload_names[NELEMS(workloads)];
+	for (size_t i = 0; i < NELEMS(workloads); i++)
+		workload_names[i] = workloads[i].name;
+	records_t r;
+	if (records_make(&r, d, seed) < 0)
+		return -1;
+	int rv = -1;
+	const int report = selected(names, count, "build", benchmarks, NELEMS(benchmarks));
+	if (bench_build(output, d, &r, file, report) < 0) /* always done, the others need the database */
+		goto done;
+	for (size_t i = 0; i < NELEMS(modes); i++) {
+		const access_t *m = &modes[i];
+		for (size_t j = 0; j < NELEMS(workloads); j++)
+			if (selected(names, count, "lookup", benchmarks, NELEMS(benchmarks)) && selected(names, count, workloads[j].name, workload_names, NELEMS(workload_names)))
+				if (bench_lookup(output, d, &r, m, &workloads[j], file, seed) < 0)
+					goto done;
+		if (selected(names, count, "iterate", benchmarks, NELEMS(benchmarks)) && bench_iterate(output, d, &r, m, file) < 0)
+			goto done;
+		if (selected(names, count, "dump", benchmarks, NELEMS(benchmarks)) && bench_dump(output, d, m, file) < 0)
+			goto done;
+	}
+	rv = 0;
+done:
+	records_free(&r);
+	(void)remove(file);
+	return rv;
+}
+
+static int help(FILE *output, const char *arg0) {
+	assert(output);
+	assert(arg0);
+	static const char *usage = "\
+Usage: %s [-h] [-f file.cdb] [-s seed] [name...]\n\n\
+Run the benchmarks and print the results out in a comma separated format.\n\
+Any names given select what is run, they can be the names of benchmarks,\n\
+datasets, lookup workloads or hashes, if none of a kind are given all of\n\
+that kind are run.\n\n\
+\t-h         : print this help and exit\n\
+\t-f file    : database file to make and remove (default \"%s\")\n\
+\t-s number  : seed for making datasets (default 0)\n\n";
+	if (fprintf(output, usage, arg0, BENCH_FILE) < 0)
+		return -1;
+	const char *sep = "benchmarks:";
+	for (size_t i = 0; i < NELEMS(benchmarks); i++, sep = "")
+		if (fprintf(output, "%s %s", sep, benchmarks[i]) < 0)
+			return -1;
+	sep = "\ndatasets:";
+	for (size_t i = 0; i < NELEMS(datasets); i++, sep = "")
+		if (fprintf(output, "%s %s", sep, datasets[i].name) < 0)
+			return -1;
+	sep = "\nworkloads:";
+	for (size_t i = 0; i < NELEMS(workloads); i++, sep = "")
+		if (fprintf(output, "%s %s", sep, workloads[i].name) < 0)
+			return -1;
+	sep = "\nhashes:";
+	for (unsigned id = 0; cdb_hash_info(id); id++, sep = "")
+		if (fprintf(output, "%s %s", sep, cdb_hash_info(id)->name) < 0)
+			return -1;
+	return fputc('\n', output) < 0 ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+	const char *file = BENCH_FILE;
+	uint64_t seed = 0;
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		const char *o = argv[i];
+		if (!strcmp(o, "-h"))
+			return help(stdout, argv[0]) < 0 ? 1 : 0;
+		if ((!strcmp(o, "-f") || !strcmp(o, "-s")) && (i + 1) < argc) {
+			if (o[1] == 'f')
+				file = argv[++i];
+			else
+				seed = strtoull(argv[++i], NULL, 0);
+			continue;
+		}
+		(void)help(stderr, argv[0]);
+		return 1;
+	}
+	char **names = argv + i;
+	const int count = argc - i;
+
+	const char *hash_names[64], *dataset_names[NELEMS(datasets)];
+	unsigned hashes = 0;
+	for (; cdb_hash_info(hashes) && hashes < NELEMS(hash_names); hashes++)
+		hash_names[hashes] = cdb_hash_info(hashes)->name;
+	for (size_t j = 0; j < NELEMS(datasets); j++)
+		dataset_names[j] = datasets[j].name;
+
+	unsigned long version = 0;
+	(void)cdb_version(&version);
+	if (printf("# version,0x%lx\n# benchmark,name,parameter,metric,value\n", version) < 0)
+		return 1;
+	if (selected(names, count, "hash", benchmarks, NELEMS(benchmarks))) {
+		uint8_t keys[2ul * MAX_KEY_LENGTH];
+		uint64_t s[2] = { seed, 0, };
+		for (size_t j = 0; j < sizeof keys; j++)
+			keys[j] = cdb_prng(s);
+		for (unsigned id = 0; id < hashes; id++)
+			if (selected(names, count, hash_names[id], hash_names, hashes) && bench_hash(stdout, cdb_hash_info(id), keys) < 0)
+				return 1;
+	}
+	int database = 0;
+	for (size_t j = 1; j < NELEMS(benchmarks); j++)
+		database |= selected(names, count, benchmarks[j], benchmarks, NELEMS(benchmarks));
+	for (size_t j = 0; database && j < NELEMS(datasets); j++) {
+		if (!selected(names, count, datasets[j].name, dataset_names, NELEMS(dataset_names)))
+			continue;
+		if (bench_dataset(stdout, &datasets[j], names, count, file, seed) < 0) {
+			(void)fprintf(stderr, "%s: dataset %s failed\n", argv[0], datasets[j].name);
+			return 1;
+		}
+		if (fflush(stdout) < 0)
+			return 1;
+	}
+	return fflush(stdout) < 0 ? 1 : 0;
+}
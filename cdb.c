@@ -25,7 +25,11 @@
 #define CDB_WRITE_ON (1)
 #endif
 
-#ifndef CDB_MEMORY_INDEX_ON /* use in memory hash table if '1' for first table */
+#ifndef CDB_STATS_ON /* keep the counters in "cdb_stats_t" for each handle, off so lookups pay nothing for them */
+#define CDB_STATS_ON (0)
+#endif
+
+#ifndef CDB_MEMORY_INDEX_ON /* always use in memory hash table if '1' for first table, see CDB_OPTION_INDEX */
 #define CDB_MEMORY_INDEX_ON (0)
 #endif
 
@@ -33,6 +37,38 @@
 #define CDB_READ_BUFFER_LENGTH      (256ul)
 #endif
 
+#ifndef CDB_PROBE_LENGTH /* number of secondary hash table slots read at once in a lookup */
+#define CDB_PROBE_LENGTH            (16ul)
+#endif
+
+#ifndef CDB_SPILL_LENGTH /* bytes of hash table entries read or written to the spill at once */
+#define CDB_SPILL_LENGTH            (4096ul)
+#endif
+
+#ifndef CDB_PLACE_CACHE /* number of probe sequences remembered when placing entries in a table */
+#define CDB_PLACE_CACHE             (64ul)
+#endif
+
+#ifndef CDB_PARTITION_SAMPLE /* number of record positions looked at for each range made by "cdb_partition" */
+#define CDB_PARTITION_SAMPLE        (64ul)
+#endif
+
+#ifndef CDB_FILTER_BLOCK /* bytes in each block of the Bloom filter, all the bits for a key are in one block */
+#define CDB_FILTER_BLOCK            (64ul)
+#endif
+
+#ifndef CDB_FILTER_EXTENSION /* appended to the name of a database to get the name of its filter */
+#define CDB_FILTER_EXTENSION        ".filter"
+#endif
+
+#ifndef CDB_CHUNK_LENGTH /* maximum number of hash table entries in a chunk when creating */
+#define CDB_CHUNK_LENGTH            (256ul)
+#endif
+
+#ifndef CDB_BLOCK_LENGTH /* maximum size in bytes of the blocks chunks are carved out of */
+#define CDB_BLOCK_LENGTH            (1024ul * 1024ul)
+#endif
+
 #ifndef CDB_USE_SDBM64 /* Use SDBM hash for the 64-bit version of the library */
 #define CDB_USE_SDBM64 (0) 
 #endif
@@ -43,11 +79,33 @@
 
 #define cdb_implies(P, Q)           cdb_assert(!(P) || (Q))
 
+#ifndef CDB_PREFETCH /* hint that memory will be needed soon */
+#ifdef __GNUC__
+#define CDB_PREFETCH(X)             __builtin_prefetch((X))
+#else
+#define CDB_PREFETCH(X)             ((void)(X))
+#endif
+#endif
+
+#ifndef CDB_ATOMIC_LOAD /* word sized loads and stores that do not tear, for the cache shared by clones */
+#ifdef __GNUC__
+#define CDB_ATOMIC_LOAD(X)          __atomic_load_n((X), __ATOMIC_RELAXED)
+#define CDB_ATOMIC_STORE(X, V)      __atomic_store_n((X), (V), __ATOMIC_RELAXED)
+#else
+#define CDB_ATOMIC_LOAD(X)          (*(volatile cdb_word_t *)(X))
+#define CDB_ATOMIC_STORE(X, V)      (*(volatile cdb_word_t *)(X) = (V))
+#endif
+#endif
+
 #define CDB_BUILD_BUG_ON(condition) ((void)sizeof(char[1 - 2*!!(condition)]))
 #define CDB_MIN(X, Y)               ((X) < (Y) ? (X) : (Y))
+#define CDB_MAX(X, Y)               ((X) > (Y) ? (X) : (Y))
+#define CDB_STAT(CDB, STATEMENT)    do { if (CDB_STATS_ON) { (CDB)->stats.STATEMENT; } } while (0)
 #define CDB_NBUCKETS                (8ul)
 #define CDB_BUCKETS                 (1ul << CDB_NBUCKETS)
 #define CDB_FILE_START              (0ul)
+#define CDB_FILTER_MAGIC            "cdbfltr1"
+#define CDB_FILTER_HEADER           (7ul * 8ul) /* magic, then six 64-bit fields, see "cdb_filter_write" */
 
 /* This enumeration is here and not in the header deliberately, it is to
  * stop error codes becoming part of the API for this library. */
@@ -75,26 +133,64 @@ typedef struct {
 	cdb_word_t length;   /* number of buckets in hash table */
 } cdb_hash_header_t; /* initial hash table structure */
 
-/* NB. More is allocated than needed for the memory index, it
- * would make things ugly to correct this however, so it will not be. */
+typedef union {
+	void *p;
+	cdb_word_t w;
+	uint64_t u;
+} cdb_align_t; /* used to align memory carved out of blocks */
+
+typedef struct cdb_chunk {
+	struct cdb_chunk *next;   /* next chunk of the same hash table, in the order added */
+	cdb_word_t length;        /* number of entries in this chunk */
+	cdb_word_t capacity;      /* maximum number of entries in this chunk */
+	cdb_align_t entries[];    /* (hash, position) pairs packed in the word size of the database */
+} cdb_chunk_t; /* hash table entries made when creating */
+
+typedef struct cdb_block {
+	struct cdb_block *next;   /* previously allocated block */
+	size_t length, used;      /* size in bytes of 'memory' and how much of it has been used */
+	cdb_align_t memory[];     /* chunks are carved out of here */
+} cdb_block_t; /* chunks are allocated from blocks, which are freed all at once */
+
 typedef struct {
-	cdb_word_t *hashes;       /* full key hashes */
-	cdb_word_t *fps;          /* file pointers */
-	cdb_hash_header_t header; /* header for this hash table */
+	cdb_chunk_t *head, *tail; /* entries in the order they were added, allocated from the blocks */
+	cdb_hash_header_t header; /* header for this hash table, 'length' is the number of entries in memory until finalized */
+	cdb_word_t spilled;       /* number of entries spilled to disk, see the "memory" option */
 } cdb_hash_table_t; /* secondary hash table structure */
 
 struct cdb { /* constant database handle: for all your querying needs! */
 	cdb_options_t ops;     /* custom file/flash operators */
 	void	*file;         /* database handle */
+	const uint8_t *memory; /* database mapped into memory (offset already applied), if available, read mode only */
+	uint64_t length;       /* length of 'memory' in bytes */
 	cdb_word_t file_start, /* start position of structures in file */
 	       file_end,       /* end position of database in file, if known, zero otherwise */
 	       hash_start;     /* start of secondary hash tables near end of file, if known, zero otherwise */
+	cdb_hash_header_t *index; /* initial hash table in memory, if CDB_OPTION_INDEX is set, read mode only */
+	cdb_word_t *cache;     /* 'ops.cache' (hash, record position) pairs of keys found, shared with clones, read mode only */
+	uint8_t *filter;       /* Bloom filter of the hashes of the keys, shared with clones, if the "filter" option is set */
+	uint64_t check;        /* checksum of the initial hash table, part of the one used to match a filter to its database */
+	size_t filter_blocks;  /* number of CDB_FILTER_BLOCK byte blocks in 'filter' */
+	unsigned filter_bits;  /* number of bits set in a block of 'filter' for each key */
+	cdb_stats_t stats;     /* counters for "cdb_stats_get", only 'hits' and 'misses' are kept unless CDB_STATS_ON is set */
+	uint8_t *tables;       /* copy of secondary hash tables from 'hash_start' to 'file_end', if CDB_OPTION_TABLES is set and not mapped */
+	uint8_t *buffer;       /* write buffer of 'ops.buffer' bytes if that option is set, in read mode it is the read ahead buffer used within 'cdb_foreach' */
+	size_t used;           /* bytes of 'buffer' waiting to be written */
+	cdb_word_t ahead;      /* file position of the read ahead buffer, read mode only */
+	size_t ahead_length;   /* bytes in the read ahead buffer, zero if it is not in use */
+	char *name;            /* name of database, create mode only, if the "memory" or "filter" options are set */
+	void *spill;           /* temporary resource hash table entries are spilled to, opened when first needed */
+	cdb_word_t *runs;      /* number of entries spilled for each bucket in each run, CDB_BUCKETS per run */
+	size_t nruns;          /* number of runs spilled */
+	cdb_block_t *blocks;   /* blocks that hash table chunks are allocated from, create mode only */
+	size_t allocated;      /* bytes allocated for 'blocks' */
 	cdb_word_t position;   /* read/write/seek position: be careful with this variable! */
 	int error;             /* error, if any, any error causes database to be invalid */
 	unsigned create : 1,   /* have we opened database up in create mode? */
 		 opened : 1,   /* have we successfully opened up the database? */
 		 empty  : 1,   /* is the database empty? */
-		 sought : 1;   /* have we performed at least one seek (needed to position init cache) */
+		 sought : 1,   /* have we performed at least one seek (needed to position init cache) */
+		 clone  : 1;   /* is this a clone, which shares (and must not free) 'file', 'memory', 'index', 'tables', 'cache' and 'filter' */
 	cdb_hash_table_t table1[]; /* only allocated if in create mode, BUCKETS elements are allocated */
 };
 
@@ -110,7 +206,7 @@ int cdb_version(unsigned long *version) {
 	spec |= CDB_TESTS_ON        << 4;
 	spec |= CDB_WRITE_ON        << 5;
 	spec |= CDB_MEMORY_INDEX_ON << 6;
-	/*spec |= 0                 << 7; */
+	spec |= CDB_STATS_ON        << 7;
 	*version = (spec << 24) | CDB_VERSION;
 	return CDB_VERSION == 0 ? CDB_ERROR_E : CDB_OK_E;
 }
@@ -120,6 +216,33 @@ int cdb_status(cdb_t *cdb) {
 	return cdb->error;
 }
 
+int cdb_cache_counts(cdb_t *cdb, uint64_t *hits, uint64_t *misses) {
+	cdb_assert(cdb);
+	cdb_assert(hits);
+	cdb_assert(misses);
+	*hits   = cdb->stats.hits;
+	*misses = cdb->stats.misses;
+	return cdb->error;
+}
+
+int cdb_stats_get(cdb_t *cdb, cdb_stats_t *stats) {
+	cdb_assert(cdb);
+	cdb_assert(stats);
+	*stats = cdb->stats;
+	if (cdb->error)
+		return cdb->error;
+	return CDB_STATS_ON ? 1 : CDB_OK_E;
+}
+
+/* Bucket 0 is for zero, bucket "i" for 2^(i-1) up to 2^i - 1, and the last
+ * bucket for anything bigger */
+static inline unsigned cdb_stats_bucket(uint64_t n) {
+	unsigned b = 0;
+	for (; n && b < (CDB_STATS_BUCKETS - 1u); n >>= 1)
+		b++;
+	return b;
+}
+
 static inline size_t cdb_get_size(cdb_t *cdb) {
 	cdb_assert(cdb);
 	return cdb->ops.size;
@@ -137,8 +260,9 @@ static inline uint64_t cdb_get_mask(cdb_t *cdb) {
 }
 
 /* This is not 'djb2' hash - the character is xor'ed in and not added. This
- * has sometimes been called 'DJB2a'. */
-static inline uint32_t cdb_djb_hash(const uint8_t *s, const size_t length) {
+ * has sometimes been called 'DJB2a'. This is the reference version, which
+ * the faster versions are tested against. */
+static inline uint32_t cdb_djb_hash_reference(const uint8_t *s, const size_t length) {
 	cdb_assert(s);
 	uint32_t h = 5381ul;
 	for (size_t i = 0; i < length; i++)
@@ -146,7 +270,7 @@ static inline uint32_t cdb_djb_hash(const uint8_t *s, const size_t length) {
 	return h;
 }
 
-static inline cdb_word_t cdb_djb64_hash(const uint8_t *s, const size_t length) {
+static inline uint64_t cdb_djb64_hash_reference(const uint8_t *s, const size_t length) {
 	cdb_assert(s);
 	uint64_t h = 5381ull;
 	for (size_t i = 0; i < length; i++)
@@ -154,6 +278,44 @@ static inline cdb_word_t cdb_djb64_hash(const uint8_t *s, const size_t length) {
 	return h;
 }
 
+/* Each step depends on the one before it and that cannot be restructured
+ * away; the xor does not distribute over the multiplication, so the bytes
+ * cannot be combined with powers of 33 and folded in at the end, as the
+ * lowest byte of the hash feeds back into every step. What can be removed
+ * is the loop overhead, four bytes are done per iteration and the rest with
+ * a switch, keys of less than four bytes skip the loop entirely. */
+#define CDB_DJB_STEP(H, C) ((H) = (((H) << 5) + (H)) ^ (C))
+
+#define CDB_DJB_UNROLLED(H, S, LENGTH) do {\
+	size_t i = 0;\
+	for (; ((LENGTH) - i) >= 4; i += 4) {\
+		CDB_DJB_STEP((H), (S)[i + 0]);\
+		CDB_DJB_STEP((H), (S)[i + 1]);\
+		CDB_DJB_STEP((H), (S)[i + 2]);\
+		CDB_DJB_STEP((H), (S)[i + 3]);\
+	}\
+	switch ((LENGTH) - i) {\
+	case 3: CDB_DJB_STEP((H), (S)[i]); i++; /* fall through */\
+	case 2: CDB_DJB_STEP((H), (S)[i]); i++; /* fall through */\
+	case 1: CDB_DJB_STEP((H), (S)[i]); i++; /* fall through */\
+	default: break;\
+	}\
+} while (0)
+
+static inline uint32_t cdb_djb_hash(const uint8_t *s, const size_t length) {
+	cdb_assert(s);
+	uint32_t h = 5381ul;
+	CDB_DJB_UNROLLED(h, s, length);
+	return h;
+}
+
+static inline cdb_word_t cdb_djb64_hash(const uint8_t *s, const size_t length) {
+	cdb_assert(s);
+	uint64_t h = 5381ull;
+	CDB_DJB_UNROLLED(h, s, length);
+	return h;
+}
+
 /* A 64-bit hash has to be used for the 64-bit database version otherwise if 
  * we used a 32-bit hash all of our keys and values would be
  * stored...suboptimally. */
@@ -170,6 +332,116 @@ static inline cdb_word_t cdb_sdbm64_hash(const uint8_t *s, const size_t length)
 	return hash;
 }
 
+static inline uint64_t cdb_rotl64(const uint64_t x, const unsigned r) {
+	return (x << r) | (x >> (64u - r));
+}
+
+static inline uint64_t cdb_load64(const uint8_t *b) { /* little endian, most compilers turn this into a single load */
+	cdb_assert(b);
+	uint64_t w = 0;
+	for (size_t i = 0; i < 8; i++)
+		w |= ((uint64_t)b[i]) << (i * CHAR_BIT);
+	return w;
+}
+
+static inline uint32_t cdb_load32(const uint8_t *b) {
+	cdb_assert(b);
+	return ((uint32_t)b[0] << 0) | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+/* The following hashes process eight bytes at a time and mix far better
+ * than the byte-at-a-time hashes above, which matters for long keys that
+ * are similar to each other, however using them means the database will not
+ * be readable by other CDB implementations. Both are used with a seed of
+ * zero and the results are the same as the reference implementations.
+ *
+ * See: <https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md>
+ * and: <https://github.com/aappleby/smhasher/blob/master/src/MurmurHash2.cpp> */
+
+#define CDB_XXH_P1 (0x9E3779B185EBCA87ull)
+#define CDB_XXH_P2 (0xC2B2AE3D27D4EB4Full)
+#define CDB_XXH_P3 (0x165667B19E3779F9ull)
+#define CDB_XXH_P4 (0x85EBCA77C2B2AE63ull)
+#define CDB_XXH_P5 (0x27D4EB2F165667C5ull)
+
+static inline uint64_t cdb_xxh64_round(uint64_t acc, const uint64_t input) {
+	acc += input * CDB_XXH_P2;
+	acc = cdb_rotl64(acc, 31);
+	return acc * CDB_XXH_P1;
+}
+
+static inline uint64_t cdb_xxh64_merge(uint64_t acc, const uint64_t v) {
+	acc ^= cdb_xxh64_round(0, v);
+	return (acc * CDB_XXH_P1) + CDB_XXH_P4;
+}
+
+static cdb_word_t cdb_xxh64_hash(const uint8_t *s, const size_t length) {
+	cdb_assert(s);
+	const uint8_t *const end = s + length;
+	uint64_t h = 0;
+	if (length >= 32) { /* four independent lanes */
+		uint64_t v1 = CDB_XXH_P1 + CDB_XXH_P2, v2 = CDB_XXH_P2, v3 = 0, v4 = -CDB_XXH_P1;
+		for (; (end - s) >= 32; s += 32) {
+			v1 = cdb_xxh64_round(v1, cdb_load64(s +  0));
+			v2 = cdb_xxh64_round(v2, cdb_load64(s +  8));
+			v3 = cdb_xxh64_round(v3, cdb_load64(s + 16));
+			v4 = cdb_xxh64_round(v4, cdb_load64(s + 24));
+		}
+		h = cdb_rotl64(v1, 1) + cdb_rotl64(v2, 7) + cdb_rotl64(v3, 12) + cdb_rotl64(v4, 18);
+		h = cdb_xxh64_merge(h, v1);
+		h = cdb_xxh64_merge(h, v2);
+		h = cdb_xxh64_merge(h, v3);
+		h = cdb_xxh64_merge(h, v4);
+	} else {
+		h = CDB_XXH_P5;
+	}
+	h += length;
+	for (; (end - s) >= 8; s += 8) {
+		h ^= cdb_xxh64_round(0, cdb_load64(s));
+		h = (cdb_rotl64(h, 27) * CDB_XXH_P1) + CDB_XXH_P4;
+	}
+	if ((end - s) >= 4) {
+		h ^= cdb_load32(s) * CDB_XXH_P1;
+		h = (cdb_rotl64(h, 23) * CDB_XXH_P2) + CDB_XXH_P3;
+		s += 4;
+	}
+	for (; s < end; s++) {
+		h ^= (*s) * CDB_XXH_P5;
+		h = cdb_rotl64(h, 11) * CDB_XXH_P1;
+	}
+	h ^= h >> 33;
+	h *= CDB_XXH_P2;
+	h ^= h >> 29;
+	h *= CDB_XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+static cdb_word_t cdb_murmur64a_hash(const uint8_t *s, const size_t length) {
+	cdb_assert(s);
+	const uint64_t m = 0xC6A4A7935BD1E995ull;
+	const unsigned r = 47;
+	uint64_t h = length * m;
+	size_t i = 0;
+	for (; (length - i) >= 8; i += 8) {
+		uint64_t k = cdb_load64(s + i);
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+		h ^= k;
+		h *= m;
+	}
+	if (i < length) {
+		for (size_t j = length - i; j > 0; j--) /* bytes of partial word */
+			h ^= ((uint64_t)s[i + j - 1]) << ((j - 1) * CHAR_BIT);
+		h *= m;
+	}
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+	return h;
+}
+
 typedef cdb_word_t (*cdb_hash_fn)(const uint8_t *s, const size_t length);
 
 cdb_word_t cdb_hash(const uint8_t *s, const size_t length) {
@@ -177,12 +449,59 @@ cdb_word_t cdb_hash(const uint8_t *s, const size_t length) {
 	return cdb_djb_hash(s, length);
 }
 
+static const cdb_hash_info_t cdb_hashes[] = { /* indexed by CDB_HASH_* */
+	{ .name = "djb",       .hash = cdb_hash,           .id = CDB_HASH_DJB,       .bits = 32, },
+	{ .name = "djb64",     .hash = cdb_djb64_hash,     .id = CDB_HASH_DJB64,     .bits = 64, },
+	{ .name = "sdbm64",    .hash = cdb_sdbm64_hash,    .id = CDB_HASH_SDBM64,    .bits = 64, },
+	{ .name = "xxh64",     .hash = cdb_xxh64_hash,     .id = CDB_HASH_XXH64,     .bits = 64, },
+	{ .name = "murmur64a", .hash = cdb_murmur64a_hash, .id = CDB_HASH_MURMUR64A, .bits = 64, },
+};
+
+const cdb_hash_info_t *cdb_hash_info(const unsigned id) {
+	if (id >= (sizeof (cdb_hashes) / sizeof (cdb_hashes[0])))
+		return NULL;
+	cdb_assert(cdb_hashes[id].id == id);
+	return &cdb_hashes[id];
+}
+
+const cdb_hash_info_t *cdb_hash_find(const char *name) {
+	cdb_assert(name);
+	for (unsigned i = 0; i < (sizeof (cdb_hashes) / sizeof (cdb_hashes[0])); i++)
+		if (!strcmp(cdb_hashes[i].name, name))
+			return &cdb_hashes[i];
+	return NULL;
+}
+
 static int cdb_memory_compare(const void *a, const void *b, size_t length) {
 	cdb_assert(a);
 	cdb_assert(b);
 	return memcmp(a, b, length);
 }
 
+/* Keys often share a long prefix (URLs, paths, ...) so the last word is
+ * checked early on, which finds most mismatches without looking at the
+ * bulk of the key. Words are loaded with "memcpy", which compiles down to a
+ * single unaligned load, and the bulk is left to "memcmp" which the C
+ * library usually vectorizes, picking the best version at run time. */
+static inline int cdb_key_equal(const uint8_t *a, const uint8_t *b, const size_t length) {
+	cdb_assert(a);
+	cdb_assert(b);
+	uint64_t x = 0, y = 0;
+	if (length < sizeof x)
+		return memcmp(a, b, length) == 0;
+	memcpy(&x, a, sizeof x);
+	memcpy(&y, b, sizeof y);
+	if (x != y)
+		return 0;
+	memcpy(&x, a + length - sizeof x, sizeof x);
+	memcpy(&y, b + length - sizeof y, sizeof y);
+	if (x != y)
+		return 0;
+	if (length <= (2ul * sizeof x))
+		return 1;
+	return memcmp(a + sizeof x, b + sizeof x, length - (2ul * sizeof x)) == 0;
+}
+
 static void cdb_preconditions(cdb_t *cdb) {
 	cdb_assert(cdb);
 	cdb_implies(cdb->file_end   != 0, cdb->file_end   > cdb->file_start);
@@ -248,6 +567,19 @@ static inline void *cdb_reallocate(cdb_t *cdb, void *pointer, const size_t lengt
 	return r;
 }
 
+/* Write out anything waiting in the write buffer */
+static int cdb_buffer_flush(cdb_t *cdb) {
+	cdb_preconditions(cdb);
+	if (cdb->used == 0)
+		return cdb_failure(cdb);
+	cdb_assert(cdb->buffer);
+	const size_t used = cdb->used;
+	cdb->used = 0;
+	if (cdb->ops.write(cdb->file, cdb->buffer, used) != used)
+		return cdb_error(cdb, CDB_ERROR_WRITE_E);
+	return cdb_failure(cdb);
+}
+
 /* NB. A seek can cause buffers to be flushed, which degrades performance quite a lot */
 static int cdb_seek_internal(cdb_t *cdb, const cdb_word_t position) {
 	cdb_preconditions(cdb);
@@ -258,7 +590,17 @@ static int cdb_seek_internal(cdb_t *cdb, const cdb_word_t position) {
 			return -1;
 	if (cdb->sought == 1u && cdb->position == position)
 		return cdb_error(cdb, CDB_OK_E);
+	if (cdb->memory || cdb->clone) { /* nothing to do but check the bounds, reads are positional */
+		if (cdb_bound_check(cdb, cdb->memory && position > cdb->length) < 0)
+			return -1;
+		cdb->position = position;
+		cdb->sought = 1u;
+		return cdb_error(cdb, CDB_OK_E);
+	}
+	if (cdb_buffer_flush(cdb) < 0)
+		return -1;
 	const int r = cdb->ops.seek(cdb->file, position + cdb->ops.offset);
+	CDB_STAT(cdb, seeks++);
 	if (r >= 0) {
 		cdb->position = position;
 		cdb->sought = 1u;
@@ -278,7 +620,20 @@ static cdb_word_t cdb_read_internal(cdb_t *cdb, void *buf, cdb_word_t length) {
 	cdb_assert(buf);
 	if (cdb_error(cdb, cdb->create != 0 ? CDB_ERROR_MODE_E : 0))
 		return 0;
-	const cdb_word_t r = cdb->ops.read(cdb->file, buf, length);
+	cdb_word_t r = 0;
+	if (cdb->memory) { /* short reads past the end, just like "read" */
+		const uint64_t left = cdb->length - CDB_MIN(cdb->length, (uint64_t)cdb->position);
+		r = CDB_MIN((uint64_t)length, left);
+		memcpy(buf, cdb->memory + cdb->position, r);
+	} else if (cdb->clone) { /* file position is shared with other handles */
+		r = cdb->ops.read_at(cdb->file, buf, length, cdb->position + cdb->ops.offset);
+	} else {
+		r = cdb->ops.read(cdb->file, buf, length);
+	}
+	if (!cdb->memory) {
+		CDB_STAT(cdb, reads++);
+		CDB_STAT(cdb, bytes += r);
+	}
 	const cdb_word_t n = cdb->position + r;
 	if (cdb_overflow_check(cdb, n < cdb->position) < 0)
 		return 0;
@@ -297,6 +652,20 @@ static cdb_word_t cdb_write(cdb_t *cdb, void *buf, size_t length) {
 	cdb_assert(buf);
 	if (cdb_error(cdb, cdb->create == 0 ? CDB_ERROR_MODE_E : 0))
 		return 0;
+	if (cdb->buffer) { /* gather up small writes, large ones go straight through */
+		const cdb_word_t n = cdb->position + length;
+		if (cdb_overflow_check(cdb, n < cdb->position) < 0)
+			return 0;
+		if (length > (cdb->ops.buffer - cdb->used))
+			if (cdb_buffer_flush(cdb) < 0)
+				return 0;
+		if (length < cdb->ops.buffer) {
+			memcpy(cdb->buffer + cdb->used, buf, length);
+			cdb->used += length;
+			cdb->position = n;
+			return length;
+		}
+	}
 	const cdb_word_t r = cdb->ops.write(cdb->file, buf, length);
 	const cdb_word_t n = cdb->position + r;
 	if (cdb_overflow_check(cdb, n < cdb->position) < 0)
@@ -313,7 +682,7 @@ static inline void cdb_pack(uint8_t b[/*static (sizeof (cdb_word_t))*/], cdb_wor
 		b[i] = (w >> (i * CHAR_BIT)) & 0xFFu;
 }
 
-static inline cdb_word_t cdb_unpack(uint8_t b[/*static (sizeof (cdb_word_t))*/], size_t l) {
+static inline cdb_word_t cdb_unpack(const uint8_t b[/*static (sizeof (cdb_word_t))*/], size_t l) {
 	cdb_assert(b);
 	cdb_word_t w = 0;
 	for (size_t i = 0; i < l; i++)
@@ -349,106 +718,485 @@ static int cdb_write_word_pair(cdb_t *cdb, const cdb_word_t w1, const cdb_word_t
 	return 0;
 }
 
-static int cdb_hash_free(cdb_t *cdb, cdb_hash_table_t *t) {
+static int cdb_hash_free(cdb_t *cdb) { /* frees the entries of all hash tables */
 	cdb_assert(cdb);
-	cdb_assert(t);
-	const int r1 = cdb_free(cdb, t->hashes);
-	const int r2 = cdb_free(cdb, t->fps);
-	t->hashes = NULL;
-	t->fps    = NULL;
-	/* do not free t */
-	return r1 < 0 || r2 < 0 ? -1 : 0;
+	int r = 0;
+	for (cdb_block_t *b = cdb->blocks, *n = NULL; b; b = n) {
+		n = b->next;
+		if (cdb_free(cdb, b) < 0)
+			r = -1;
+	}
+	cdb->blocks    = NULL;
+	cdb->allocated = 0;
+	for (size_t i = 0; cdb->create && i < CDB_BUCKETS; i++) {
+		cdb->table1[i].head = NULL;
+		cdb->table1[i].tail = NULL;
+	}
+	return r;
 }
 
 static int cdb_free_resources(cdb_t *cdb) {
 	if (!cdb)
 		return 0;
-	if (cdb->file)
+	if (cdb->file && !(cdb->clone))
 		cdb->ops.close(cdb->file);
 	cdb->file = NULL;
 	cdb->opened = 0;
 	int r = 0;
-	for (size_t i = 0; cdb->create && i < CDB_BUCKETS; i++)
-		if (cdb_hash_free(cdb, &cdb->table1[i]) < 0)
-			r = -1;
+	if (cdb_hash_free(cdb) < 0)
+		r = -1;
+	if (!(cdb->clone)) {
+		(void)cdb_free(cdb, cdb->index);
+		(void)cdb_free(cdb, cdb->tables);
+		(void)cdb_free(cdb, cdb->cache);
+		(void)cdb_free(cdb, cdb->filter);
+	}
+	(void)cdb_free(cdb, cdb->buffer);
+	if (cdb->spill && cdb->ops.close(cdb->spill) < 0)
+		r = -1;
+	(void)cdb_free(cdb, cdb->runs);
+	(void)cdb_free(cdb, cdb->name);
+	cdb->index  = NULL;
+	cdb->tables = NULL;
+	cdb->cache  = NULL;
+	cdb->filter = NULL;
+	cdb->buffer = NULL;
+	cdb->spill  = NULL;
+	cdb->runs   = NULL;
+	cdb->name   = NULL;
 	(void)cdb_error(cdb, CDB_ERROR_E);
 	(void)cdb->ops.allocator(cdb->ops.arena, cdb, 0, 0);
 	return r;
 }
 
+/* Run "job" for each index below "count", on many threads if the "parallel"
+ * and "threads" options allow it. Jobs must not touch the database handle,
+ * which is not thread safe, and should return negative on failure. */
+static int cdb_parallel(cdb_t *cdb, int (*job)(void *param, size_t index), void *param, const size_t count) {
+	cdb_assert(cdb);
+	cdb_assert(job);
+	if (cdb->ops.parallel && cdb->ops.threads > 1)
+		return cdb->ops.parallel(job, param, count, cdb->ops.threads) < 0 ? CDB_ERROR_E : CDB_OK_E;
+	for (size_t i = 0; i < count; i++)
+		if (job(param, i) < 0)
+			return CDB_ERROR_E;
+	return CDB_OK_E;
+}
+
+static char *cdb_name_extend(cdb_t *cdb, const char *name, const char *ext) {
+	cdb_assert(cdb);
+	cdb_assert(ext);
+	const size_t nl = name ? strlen(name) : 0, el = strlen(ext);
+	char *n = cdb_allocate(cdb, nl + el + 1ul);
+	if (!n)
+		return NULL;
+	if (nl)
+		memcpy(n, name, nl);
+	memcpy(n + nl, ext, el + 1ul);
+	return n;
+}
+
+static inline uint64_t cdb_filter_mix(uint64_t x) { /* SplitMix64 finalizer */
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ull;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBull;
+	x ^= x >> 31;
+	return x;
+}
+
+/* The hash of a key is mixed so that a weak (or a 16-bit) hash still spreads
+ * out over the filter, the top half picks the block and the bottom half the
+ * bits within it, with each bit a fixed odd step on from the last. Keys with
+ * the same hash cannot be told apart, but they share a slot in the hash
+ * tables anyway. */
+static inline uint8_t *cdb_filter_block(const cdb_t *cdb, const cdb_word_t h, unsigned *first, unsigned *step) {
+	cdb_assert(cdb);
+	cdb_assert(cdb->filter);
+	cdb_assert(first);
+	cdb_assert(step);
+	const uint64_t x = cdb_filter_mix(h);
+	const uint64_t block = ((x >> 32) * (uint64_t)cdb->filter_blocks) >> 32;
+	*first = x & ((CDB_FILTER_BLOCK * CHAR_BIT) - 1ul);
+	*step  = ((x >> 16) & ((CDB_FILTER_BLOCK * CHAR_BIT) - 1ul)) | 1u;
+	return cdb->filter + (block * CDB_FILTER_BLOCK);
+}
+
+static inline void cdb_filter_set(cdb_t *cdb, const cdb_word_t h) {
+	unsigned bit = 0, step = 0;
+	uint8_t *b = cdb_filter_block(cdb, h, &bit, &step);
+	for (unsigned i = 0; i < cdb->filter_bits; i++, bit = (bit + step) & ((CDB_FILTER_BLOCK * CHAR_BIT) - 1ul))
+		b[bit / CHAR_BIT] |= 1u << (bit % CHAR_BIT);
+}
+
+/* returns: 0 = key is definitely not in the database, 1 = it might be */
+static inline int cdb_filter_test(const cdb_t *cdb, const cdb_word_t h) {
+	unsigned bit = 0, step = 0;
+	const uint8_t *b = cdb_filter_block(cdb, h, &bit, &step);
+	for (unsigned i = 0; i < cdb->filter_bits; i++, bit = (bit + step) & ((CDB_FILTER_BLOCK * CHAR_BIT) - 1ul))
+		if (!(b[bit / CHAR_BIT] & (1u << (bit % CHAR_BIT))))
+			return 0;
+	return 1;
+}
+
+static inline uint64_t cdb_filter_check(const uint64_t check, const cdb_word_t w) {
+	return cdb_filter_mix(check ^ w) + 0x9E3779B97F4A7C15ull;
+}
+
+static inline void cdb_filter_pack(uint8_t b[/*static 8*/], const uint64_t u) {
+	cdb_assert(b);
+	for (size_t i = 0; i < 8ul; i++)
+		b[i] = (u >> (i * CHAR_BIT)) & 0xFFu;
+}
+
+static inline uint64_t cdb_filter_unpack(const uint8_t b[/*static 8*/]) {
+	cdb_assert(b);
+	uint64_t u = 0;
+	for (size_t i = 0; i < 8ul; i++)
+		u |= ((uint64_t)b[i]) << (i * CHAR_BIT);
+	return u;
+}
+
+/* Fold placed secondary hash tables, always a multiple of eight bytes, into a checksum */
+static uint64_t cdb_filter_sum(uint64_t sum, const uint8_t *b, const cdb_word_t length) {
+	cdb_assert(b);
+	cdb_assert((length % 8ul) == 0);
+	for (cdb_word_t i = 0; i < length; i += 8ul)
+		sum = cdb_filter_check(sum, cdb_filter_unpack(b + i));
+	return sum;
+}
+
+/* Checksum of the secondary hash tables of a database being read */
+static int cdb_filter_tables(cdb_t *cdb, uint64_t *sum) {
+	cdb_assert(cdb);
+	cdb_assert(sum);
+	const cdb_word_t length = cdb->file_end - cdb->hash_start;
+	*sum = 0;
+	if (cdb->memory || cdb->tables) {
+		*sum = cdb_filter_sum(0, cdb->memory ? cdb->memory + cdb->hash_start : cdb->tables, length);
+		return CDB_OK_E;
+	}
+	uint8_t b[512];
+	if (cdb_seek_internal(cdb, cdb->hash_start) < 0)
+		return CDB_ERROR_E;
+	for (cdb_word_t i = 0; i < length; i += sizeof (b)) {
+		const cdb_word_t l = CDB_MIN(length - i, (cdb_word_t)sizeof (b));
+		if (cdb_read_internal(cdb, b, l) != l)
+			return cdb_error(cdb, CDB_ERROR_READ_E);
+		*sum = cdb_filter_sum(*sum, b, l);
+	}
+	return cdb_seek_internal(cdb, cdb->file_start);
+}
+
+/* Add the hashes of the occupied slots of placed hash tables to the filter */
+static void cdb_filter_table(cdb_t *cdb, const uint8_t *out, const cdb_word_t slots) {
+	cdb_assert(cdb);
+	cdb_assert(out);
+	const size_t l = cdb_get_size(cdb), w = 2ul * l;
+	for (cdb_word_t i = 0; i < slots; i++, out += w)
+		if (cdb_unpack(out + l, l))
+			cdb_filter_set(cdb, cdb_unpack(out, l));
+}
+
+/* The filter is kept in its own file next to the database so the database
+ * stays readable by other CDB programs. It starts with a header that ties it
+ * to the database it was made for, which is made up of the magic string and
+ * the following little endian 64-bit fields: the word size, the number of
+ * bits set for each key, the number of blocks, the end of the database, the
+ * start of the secondary hash tables, and a checksum of all of the hash
+ * tables. The blocks follow. */
+static int cdb_filter_write(cdb_t *cdb, const uint64_t check) {
+	cdb_assert(cdb);
+	cdb_assert(cdb->filter);
+	char *name = cdb_name_extend(cdb, cdb->name, CDB_FILTER_EXTENSION);
+	if (!name)
+		return CDB_ERROR_E;
+	void *f = cdb->ops.open(name, CDB_RW_MODE);
+	if (cdb_free(cdb, name) < 0 || !f) {
+		if (f)
+			(void)cdb->ops.close(f);
+		return cdb_error(cdb, CDB_ERROR_OPEN_E);
+	}
+	uint8_t h[CDB_FILTER_HEADER] = { 0, };
+	const uint64_t fields[] = { cdb_get_size(cdb), cdb->filter_bits, cdb->filter_blocks, cdb->file_end, cdb->hash_start, check, };
+	memcpy(h, CDB_FILTER_MAGIC, 8ul);
+	for (size_t i = 0; i < (sizeof (fields) / sizeof (fields[0])); i++)
+		cdb_filter_pack(h + 8ul + (i * 8ul), fields[i]);
+	const size_t bytes = cdb->filter_blocks * CDB_FILTER_BLOCK;
+	int r = CDB_OK_E;
+	if (cdb->ops.write(f, h, sizeof (h)) != sizeof (h) || cdb->ops.write(f, cdb->filter, bytes) != bytes)
+		r = cdb_error(cdb, CDB_ERROR_WRITE_E);
+	if (r == CDB_OK_E && cdb->ops.flush && cdb->ops.flush(f) < 0)
+		r = cdb_error(cdb, CDB_ERROR_WRITE_E);
+	if (cdb->ops.close(f) < 0)
+		r = cdb_error(cdb, CDB_ERROR_E);
+	return r;
+}
+
+/* A missing filter, or one that does not match the database, is not an
+ * error, lookups just go without it. */
+static int cdb_filter_load(cdb_t *cdb, const char *file) {
+	cdb_assert(cdb);
+	char *name = cdb_name_extend(cdb, file, CDB_FILTER_EXTENSION);
+	if (!name)
+		return CDB_ERROR_E;
+	void *f = cdb->ops.open(name, CDB_RO_MODE);
+	if (cdb_free(cdb, name) < 0) {
+		if (f)
+			(void)cdb->ops.close(f);
+		return CDB_ERROR_E;
+	}
+	if (!f)
+		return CDB_OK_E;
+	uint8_t h[CDB_FILTER_HEADER] = { 0, };
+	uint8_t *filter = NULL;
+	if (cdb->ops.seek(f, 0) < 0 || cdb->ops.read(f, h, sizeof (h)) != sizeof (h))
+		goto done;
+	uint64_t fields[6] = { 0, };
+	for (size_t i = 0; i < (sizeof (fields) / sizeof (fields[0])); i++)
+		fields[i] = cdb_filter_unpack(h + 8ul + (i * 8ul));
+	if (memcmp(h, CDB_FILTER_MAGIC, 8ul) || fields[0] != cdb_get_size(cdb) || fields[1] == 0 || fields[1] > (CDB_FILTER_BLOCK * CHAR_BIT))
+		goto done;
+	if (fields[2] == 0 || fields[2] > UINT32_MAX || fields[3] != cdb->file_end || fields[4] != cdb->hash_start)
+		goto done;
+	if (cdb->file_end < cdb->hash_start || ((cdb->file_end - cdb->hash_start) % 8ul))
+		goto done;
+	uint64_t sum = 0; /* swapping a key for another in the same bucket leaves the initial table as it was */
+	if (cdb_filter_tables(cdb, &sum) < 0) {
+		(void)cdb->ops.close(f);
+		return CDB_ERROR_E;
+	}
+	if (fields[5] != cdb_filter_check(cdb->check, sum))
+		goto done;
+	const size_t bytes = fields[2] * CDB_FILTER_BLOCK;
+	if ((bytes / CDB_FILTER_BLOCK) != fields[2])
+		goto done;
+	if (!(filter = cdb_allocate(cdb, bytes))) {
+		(void)cdb->ops.close(f);
+		return CDB_ERROR_E;
+	}
+	if (cdb->ops.read(f, filter, bytes) != bytes)
+		goto done;
+	cdb->filter        = filter;
+	cdb->filter_blocks = fields[2];
+	cdb->filter_bits   = fields[1];
+	filter             = NULL;
+done:
+	(void)cdb_free(cdb, filter);
+	return cdb->ops.close(f) < 0 ? cdb_error(cdb, CDB_ERROR_E) : CDB_OK_E;
+}
+
+typedef struct {
+	uint8_t *out;     /* secondary hash table as it is laid out on disk */
+	cdb_word_t slots; /* number of slots in 'out' */
+	size_t size;      /* word size in bytes */
+	struct {
+		cdb_word_t start, end; /* slots from 'start' to 'end' are occupied, 'start' is biased by one, zero is unused */
+	} probes[CDB_PLACE_CACHE];
+} cdb_placer_t; /* used to place entries into a single secondary hash table */
+
+static void cdb_placer_init(cdb_placer_t *p, uint8_t *out, const cdb_word_t slots, const size_t size) {
+	cdb_assert(p);
+	cdb_assert(out);
+	memset(p, 0, sizeof (*p));
+	memset(out, 0, slots * 2ul * size);
+	p->out   = out;
+	p->slots = slots;
+	p->size  = size;
+}
+
+/* Place an entry with linear probing, a slot is empty if its position is
+ * zero, records can never be at position zero. Keys that are added many
+ * times all start probing at the same slot, which takes longer for each
+ * one added, so where the last probe from the same start ended is
+ * remembered and probing continues from there, which gives the same
+ * result as the slots in between must all be occupied. */
+static inline void cdb_table_place(cdb_placer_t *p, const cdb_word_t h, const cdb_word_t pos) {
+	cdb_assert(p);
+	cdb_assert(p->slots);
+	const size_t l = p->size, w = 2ul * l;
+	const cdb_word_t start = (h >> CDB_NBUCKETS) % p->slots;
+	cdb_word_t k = start;
+	const size_t c = start % CDB_PLACE_CACHE;
+	if (p->probes[c].start == (start + 1ul))
+		k = p->probes[c].end;
+	while (cdb_unpack(p->out + (k * w) + l, l))
+		if (++k == p->slots)
+			k = 0;
+	cdb_pack(p->out + (k * w),     h,   l);
+	cdb_pack(p->out + (k * w) + l, pos, l);
+	p->probes[c].start = start + 1ul;
+	p->probes[c].end   = k;
+}
+
+/* Place the entries of a secondary hash table held in memory, this does
+ * not touch the handle so many tables can be placed at once. */
+static void cdb_table_pack(const cdb_hash_table_t *t, cdb_placer_t *p) {
+	cdb_assert(t);
+	cdb_assert(p);
+	const size_t l = p->size;
+	for (const cdb_chunk_t *c = t->head; c; c = c->next) {
+		const uint8_t *e = (const uint8_t *)c->entries;
+		for (cdb_word_t j = 0; j < c->length; j++, e += 2ul * l)
+			cdb_table_place(p, cdb_unpack(e, l), cdb_unpack(e + l, l));
+	}
+}
+
+/* Entries spilled for a table are spread out over all of the runs, they are
+ * placed before those in memory as they were added first. The runs are
+ * visited in bucket order so "cursors" only ever move forward. */
+static int cdb_table_unspill(cdb_t *cdb, const size_t bucket, cdb_word_t *cursors, cdb_placer_t *p) {
+	cdb_assert(cdb);
+	cdb_assert(cursors);
+	cdb_assert(p);
+	const size_t l = cdb_get_size(cdb), w = 2ul * l;
+	for (size_t r = 0; r < cdb->nruns; r++) {
+		cdb_word_t n = cdb->runs[(r * CDB_BUCKETS) + bucket];
+		if (n && cdb->ops.seek(cdb->spill, cursors[r]) < 0)
+			return cdb_error(cdb, CDB_ERROR_SEEK_E);
+		cursors[r] += n * w;
+		while (n) {
+			uint8_t b[CDB_SPILL_LENGTH]; /* NOT INITIALIZED */
+			const size_t entries = CDB_MIN(n, (cdb_word_t)(sizeof (b) / w));
+			if (cdb->ops.read(cdb->spill, b, entries * w) != (entries * w))
+				return cdb_error(cdb, CDB_ERROR_READ_E);
+			for (size_t i = 0; i < entries; i++)
+				cdb_table_place(p, cdb_unpack(b + (i * w), l), cdb_unpack(b + (i * w) + l, l));
+			n -= entries;
+		}
+	}
+	return cdb_failure(cdb);
+}
+
+typedef struct {
+	const cdb_hash_table_t *tables; /* CDB_BUCKETS tables, positions already set */
+	uint8_t *out;                   /* all tables as they are laid out on disk */
+	cdb_word_t start;               /* file position of 'out' */
+	size_t size;                    /* word size in bytes */
+} cdb_finalize_t; /* used for placing secondary hash tables in parallel */
+
+static int cdb_finalize_job(void *param, size_t index) {
+	cdb_finalize_t *f = param;
+	cdb_assert(f);
+	cdb_assert(index < CDB_BUCKETS);
+	const cdb_hash_table_t *t = &f->tables[index];
+	if (t->header.length == 0)
+		return 0;
+	cdb_placer_t p; /* NOT INITIALIZED */
+	cdb_placer_init(&p, f->out + (t->header.position - f->start), t->header.length * 2ul, f->size);
+	cdb_table_pack(t, &p);
+	return 0;
+}
+
 static inline int cdb_finalize(cdb_t *cdb) { /* write hash tables to disk */
 	cdb_assert(cdb);
 	cdb_assert(cdb->error == 0);
 	cdb_assert(cdb->create == 1);
 	if (CDB_WRITE_ON == 0)
 		return cdb_error(cdb, CDB_ERROR_DISABLED_E);
-	int r = 0;
-	cdb_word_t mlen = 8;
-	cdb_word_t *hashes    = cdb_allocate(cdb, mlen * sizeof *hashes);
-	cdb_word_t *positions = cdb_allocate(cdb, mlen * sizeof *positions);
-	if (!hashes || !positions)
-		goto fail;
+	const size_t w = 2ul * cdb_get_size(cdb);
+	const int parallel = cdb->ops.parallel && cdb->ops.threads > 1 && cdb->nruns == 0;
+	uint8_t *out = NULL;
+	cdb_word_t *cursors = NULL;
 	/* NB. No need to seek as we are the only thing that can affect
 	 * cdb->position in write mode */
 	cdb->hash_start = cdb->position;
 
-	for (size_t i = 0; i < CDB_BUCKETS; i++) { /* write tables at end of file */
+	cdb_word_t position = cdb->position, largest = 0;
+	uint64_t sum = 0; /* of the secondary tables, for the filter */
+	for (size_t i = 0; i < CDB_BUCKETS; i++) { /* work out where each table goes */
 		cdb_hash_table_t *t = &cdb->table1[i];
-		const cdb_word_t length = t->header.length * 2ul;
-		t->header.position = cdb->position; /* needs to be set */
-		if (length == 0)
-			continue;
-		if (cdb_bound_check(cdb, length < t->header.length) < 0)
+		const cdb_word_t entries = t->header.length + t->spilled;
+		const cdb_word_t length = entries * 2ul, bytes = length * w;
+		if (cdb_overflow_check(cdb, entries < t->spilled || length < entries || (bytes / w) != length) < 0)
 			goto fail;
-		if (mlen < length) {
-			const cdb_word_t required = length * sizeof (cdb_word_t);
-			if (cdb_overflow_check(cdb, required < length) < 0)
-				goto fail;
-			cdb_word_t *t1 = cdb_reallocate(cdb, hashes, required);
-			if (!t1)
-				goto fail;
-			hashes = t1;
-			cdb_word_t *t2 = cdb_reallocate(cdb, positions, required);
-			if (!t2)
-				goto fail;
-			positions = t2;
-			mlen = length;
-		}
+		t->header.position = position; /* needs to be set */
+		if (cdb_overflow_check(cdb, (position + bytes) < position || (position + bytes) > cdb_get_mask(cdb)) < 0)
+			goto fail;
+		position += bytes;
+		largest = bytes > largest ? bytes : largest;
+	}
+	const cdb_word_t total = position - cdb->hash_start;
+	if (cdb_overflow_check(cdb, (size_t)total != total) < 0)
+		goto fail;
 
-		memset(hashes,    0, length * sizeof (cdb_word_t));
-		memset(positions, 0, length * sizeof (cdb_word_t));
+	if (cdb->ops.filter) { /* enough blocks for "filter" bits per key, using the best number of bits for that */
+		const cdb_word_t entries = total / (2ul * w);
+		const uint64_t bits = (uint64_t)entries * cdb->ops.filter, each = CDB_FILTER_BLOCK * CHAR_BIT;
+		if (cdb_overflow_check(cdb, entries && (bits / entries) != cdb->ops.filter) < 0)
+			goto fail;
+		const uint64_t blocks = (bits / each) + 1ul;
+		if (cdb_overflow_check(cdb, blocks > UINT32_MAX || (size_t)blocks != blocks) < 0)
+			goto fail;
+		cdb->filter_blocks = blocks;
+		cdb->filter_bits = ((cdb->ops.filter * 693u) + 500u) / 1000u;
+		cdb->filter_bits = cdb->filter_bits < 1u ? 1u : cdb->filter_bits > 16u ? 16u : cdb->filter_bits;
+		if (!(cdb->filter = cdb_allocate(cdb, cdb->filter_blocks * CDB_FILTER_BLOCK)))
+			goto fail;
+	}
 
-		for (size_t j = 0; j < t->header.length; j++) {
-			const cdb_word_t h = t->hashes[j];
-			const cdb_word_t p = t->fps[j];
-			const cdb_word_t start = (h >> CDB_NBUCKETS) % length;
-			cdb_word_t k = 0;
-			for (k = start; positions[k]; k = (k + 1ul) % length)
-				;
-			hashes[k]    = h;
-			positions[k] = p;
+	if (parallel && total) { /* place all tables at once, then write them out in one go */
+		if (!(out = cdb_allocate(cdb, total)))
+			goto fail;
+		cdb_finalize_t f = { .tables = cdb->table1, .out = out, .start = cdb->hash_start, .size = cdb_get_size(cdb), };
+		if (cdb_parallel(cdb, cdb_finalize_job, &f, CDB_BUCKETS) < 0)
+			goto fail;
+		if (cdb->filter) {
+			cdb_filter_table(cdb, out, total / w);
+			sum = cdb_filter_sum(sum, out, total);
 		}
-
-		for (cdb_word_t j = 0; j < length; j++)
-			if (cdb_write_word_pair(cdb, hashes[j], positions[j]) < 0)
+		if (cdb_write(cdb, out, total) != total)
+			goto fail;
+	} else if (total) {
+		if (!(out = cdb_allocate(cdb, largest)))
+			goto fail;
+		if (cdb->nruns) { /* each run starts where the previous one ended */
+			if (!(cursors = cdb_allocate(cdb, cdb->nruns * sizeof (*cursors))))
+				goto fail;
+			for (size_t r = 1; r < cdb->nruns; r++) {
+				cdb_word_t n = 0;
+				for (size_t i = 0; i < CDB_BUCKETS; i++)
+					n += cdb->runs[((r - 1ul) * CDB_BUCKETS) + i];
+				cursors[r] = cursors[r - 1ul] + (n * w);
+			}
+		}
+		for (size_t i = 0; i < CDB_BUCKETS; i++) { /* write tables at end of file */
+			const cdb_hash_table_t *t = &cdb->table1[i];
+			const cdb_word_t bytes = (t->header.length + t->spilled) * 2ul * w;
+			if (bytes == 0)
+				continue;
+			cdb_placer_t p; /* NOT INITIALIZED */
+			cdb_placer_init(&p, out, (t->header.length + t->spilled) * 2ul, cdb_get_size(cdb));
+			if (t->spilled && cdb_table_unspill(cdb, i, cursors, &p) < 0)
 				goto fail;
+			cdb_table_pack(t, &p);
+			if (cdb->filter) {
+				cdb_filter_table(cdb, out, bytes / w);
+				sum = cdb_filter_sum(sum, out, bytes);
+			}
+			if (cdb_write(cdb, out, bytes) != bytes)
+				goto fail;
+		}
 	}
 	cdb->file_end = cdb->position;
 	if (cdb_seek_internal(cdb, cdb->file_start) < 0)
 		goto fail;
 	for (size_t i = 0; i < CDB_BUCKETS; i++) { /* write initial hash table */
 		const cdb_hash_table_t * const t = &cdb->table1[i];
-		if (cdb_write_word_pair(cdb, t->header.position, (t->header.length * 2ul)) < 0)
+		const cdb_word_t slots = (t->header.length + t->spilled) * 2ul;
+		if (cdb_write_word_pair(cdb, t->header.position, slots) < 0)
 			goto fail;
+		cdb->check = cdb_filter_check(cdb_filter_check(cdb->check, t->header.position), slots);
 	}
-	if (cdb_free(cdb, hashes) < 0)
-		r = -1;
-	if (cdb_free(cdb, positions) < 0)
-		r = -1;
-	return r == 0 && cdb->ops.flush ? cdb->ops.flush(cdb->file) : r;
+	if (cdb_buffer_flush(cdb) < 0)
+		goto fail;
+	const int r = cdb_free(cdb, out) | cdb_free(cdb, cursors);
+	if (r == 0 && cdb->ops.flush && cdb->ops.flush(cdb->file) < 0)
+		return CDB_ERROR_E;
+	return r == 0 && cdb->filter ? cdb_filter_write(cdb, cdb_filter_check(cdb->check, sum)) : r;
 fail:
-	(void)cdb_free(cdb, hashes);
-	(void)cdb_free(cdb, positions);
+	(void)cdb_free(cdb, out);
+	(void)cdb_free(cdb, cursors);
 	return cdb_error(cdb, CDB_ERROR_E);
 }
 
@@ -465,6 +1213,54 @@ fail:
 	(void)cdb_free_resources(cdb);
 	return CDB_ERROR_E;
 }
+
+/* The part of the database to be warmed, relative to its start. The initial
+ * hash table has already been read when opening and the secondary tables
+ * are one block at the end, which is what lookups need the most of. */
+static void cdb_warm_region(cdb_t *cdb, cdb_word_t *start, cdb_word_t *length) {
+	cdb_assert(cdb);
+	cdb_assert(start);
+	cdb_assert(length);
+	*start = *length = 0;
+	if (cdb->ops.flags & CDB_OPTION_WARM_ALL) {
+		*length = cdb->file_end;
+	} else if ((cdb->ops.flags & CDB_OPTION_WARM) && !cdb->tables) {
+		*start  = cdb->hash_start;
+		*length = cdb->file_end - cdb->hash_start;
+	}
+}
+
+static void cdb_advise(cdb_t *cdb) {
+	cdb_assert(cdb);
+	cdb_assert(cdb->ops.advise);
+	const cdb_word_t records = CDB_BUCKETS * (2ul * cdb_get_size(cdb));
+	if ((cdb->ops.flags & CDB_OPTION_RANDOM) && cdb->hash_start > records)
+		(void)cdb->ops.advise(cdb->file, cdb->ops.offset + records, cdb->hash_start - records, CDB_ADVISE_RANDOM);
+	cdb_word_t start = 0, length = 0;
+	cdb_warm_region(cdb, &start, &length);
+	if (length)
+		(void)cdb->ops.advise(cdb->file, cdb->ops.offset + start, length, CDB_ADVISE_WILLNEED);
+}
+
+int cdb_warm_progress(cdb_t *cdb, uint64_t *resident, uint64_t *length) {
+	cdb_preconditions(cdb);
+	cdb_assert(resident);
+	cdb_assert(length);
+	*resident = *length = 0;
+	if (cdb->error)
+		return cdb->error;
+	if (cdb->create || !cdb->ops.resident || !(cdb->ops.flags & (CDB_OPTION_WARM | CDB_OPTION_WARM_ALL)))
+		return CDB_OK_E;
+	cdb_word_t start = 0, l = 0;
+	uint64_t bytes = 0;
+	cdb_warm_region(cdb, &start, &l);
+	if (l && cdb->ops.resident(cdb->file, cdb->ops.offset + start, l, &bytes) < 0)
+		return CDB_OK_E;
+	*length   = l;
+	*resident = CDB_MIN(bytes, (uint64_t)l);
+	return 1;
+}
+
 int cdb_open(cdb_t **cdb, const cdb_options_t *ops, const int create, const char *file) {
 	/* We could allow the word size of the CDB database {16, 32 (default) or 64}
 	 * to be configured at run time and not compile time, this has API related
@@ -489,8 +1285,7 @@ int cdb_open(cdb_t **cdb, const cdb_options_t *ops, const int create, const char
 	if (ops->size != 0 && ops->size > (sizeof(cdb_word_t) * CHAR_BIT))
 		return CDB_ERROR_SIZE_E;
 	cdb_t *c = NULL;
-	const int large = CDB_MEMORY_INDEX_ON || create;
-	const size_t csz = (sizeof *c) + (large * sizeof c->table1[0] * CDB_BUCKETS);
+	const size_t csz = (sizeof *c) + (create * sizeof c->table1[0] * CDB_BUCKETS);
 	c = ops->allocator(ops->arena, NULL, 0, csz);
 	if (!c)
 		goto fail;
@@ -501,6 +1296,8 @@ int cdb_open(cdb_t **cdb, const cdb_options_t *ops, const int create, const char
 	c->ops.size    = c->ops.size    ? c->ops.size / CHAR_BIT : (32ul / CHAR_BIT);
 	c->ops.hash    = c->ops.hash    ? c->ops.hash    : hash_fn;
 	c->ops.compare = c->ops.compare ? c->ops.compare : cdb_memory_compare;
+	c->ops.flags  |= CDB_MEMORY_INDEX_ON ? CDB_OPTION_INDEX : 0;
+	c->ops.flags  |= c->ops.flags & CDB_OPTION_TABLES ? CDB_OPTION_INDEX : 0;
 	c->create      = create;
 	c->empty       = 1;
 	*cdb           = c;
@@ -510,16 +1307,30 @@ int cdb_open(cdb_t **cdb, const cdb_options_t *ops, const int create, const char
 		(void)cdb_error(c, CDB_ERROR_OPEN_E);
 		goto fail;
 	}
+	if (!create && c->ops.map) { /* if mapping fails we fall back to "read" and "seek" */
+		uint64_t length = 0;
+		const uint8_t *m = c->ops.map(c->file, &length);
+		if (m && length >= c->ops.offset) {
+			c->memory = m + c->ops.offset;
+			c->length = length - c->ops.offset;
+		}
+	}
 	if (cdb_seek_internal(c, c->file_start) < 0)
 		goto fail;
 	if (create) {
+		if (c->ops.buffer)
+			if (!(c->buffer = cdb_allocate(c, c->ops.buffer)))
+				goto fail;
+		if (c->ops.memory || c->ops.filter) /* needed to name the spill and filter files */
+			if (!(c->name = cdb_name_extend(c, file, "")))
+				goto fail;
 		for (size_t i = 0; i < CDB_BUCKETS; i++) /* write empty header */
 			if (cdb_write_word_pair(c, 0, 0) < 0)
 				goto fail;
 	} else {
-		/* We allocate more memory than we need if CDB_MEMORY_INDEX_ON is
-		 * true as 'cdb_hash_table_t' contains entries needed for
-		 * creation that we do not need when reading the database. */
+		if (c->ops.flags & CDB_OPTION_INDEX)
+			if (!(c->index = cdb_allocate(c, CDB_BUCKETS * sizeof c->index[0])))
+				goto fail;
 		cdb_word_t hpos = 0, hlen = 0, lpos = -1l, lset = 0, prev = 0, pnum = 0;
 		for (size_t i = 0; i < CDB_BUCKETS; i++) {
 			cdb_hash_table_t t = { .header = { .position = 0, .length = 0 } };
@@ -529,15 +1340,16 @@ int cdb_open(cdb_t **cdb, const cdb_options_t *ops, const int create, const char
 				goto fail;
 			prev = t.header.position;
 			pnum = t.header.length;
-			if (CDB_MEMORY_INDEX_ON)
-				c->table1[i] = t;
+			c->check = cdb_filter_check(cdb_filter_check(c->check, t.header.position), t.header.length);
+			if (c->index)
+				c->index[i] = t.header;
 			if (t.header.length)
 				c->empty = 0;
 			if (t.header.length && t.header.position < lpos) {
 				lpos = t.header.position;
 				lset = 1;
 			}
-			if (t.header.position > hpos) {
+			if (t.header.position >= hpos) { /* empty tables can share a position with the next one */
 				hpos = t.header.position;
 				hlen = t.header.length;
 			}
@@ -552,6 +1364,33 @@ int cdb_open(cdb_t **cdb, const cdb_options_t *ops, const int create, const char
 		}
 		if (cdb_overflow_check(c, c->file_end < hpos) < 0)
 			goto fail;
+		if (cdb_bound_check(c, c->memory && c->file_end > c->length) < 0)
+			goto fail;
+		const cdb_word_t tlen = c->file_end - c->hash_start;
+		if ((c->ops.flags & CDB_OPTION_TABLES) && !(c->memory) && tlen) {
+			if (cdb_bound_check(c, c->file_end < c->hash_start) < 0)
+				goto fail;
+			if (cdb_overflow_check(c, (size_t)tlen != tlen) < 0)
+				goto fail;
+			if (!(c->tables = cdb_allocate(c, tlen)))
+				goto fail;
+			if (cdb_seek_internal(c, c->hash_start) < 0)
+				goto fail;
+			if (cdb_read_internal(c, c->tables, tlen) != tlen)
+				goto fail;
+			if (cdb_seek_internal(c, c->file_start) < 0)
+				goto fail;
+		}
+		if (c->ops.filter && cdb_filter_load(c, file) < 0)
+			goto fail;
+		if (c->ops.cache) {
+			if (cdb_overflow_check(c, ((c->ops.cache * 2ul * sizeof (*c->cache)) / (2ul * sizeof (*c->cache))) != c->ops.cache) < 0)
+				goto fail;
+			if (!(c->cache = cdb_allocate(c, c->ops.cache * 2ul * sizeof (*c->cache))))
+				goto fail;
+		}
+		if (c->ops.advise) /* only hints, nothing is read here */
+			cdb_advise(c);
 	}
 	c->opened = 1;
 	return CDB_OK_E;
@@ -560,7 +1399,37 @@ fail:
 	return CDB_ERROR_E;
 }
 
-/* returns: -1 = error, 0 = not equal, 1 = equal */
+/* A clone copies everything that does not change after "cdb_open" from
+ * the original handle, it gets its own file position and error status
+ * however, and it never seeks as the file handle is shared. This means the
+ * original handle must not be written to, as other threads may be cloning
+ * it at the same time, and that the original must outlive all of its
+ * clones. */
+int cdb_clone(cdb_t **clone, cdb_t *cdb) {
+	cdb_preconditions(cdb);
+	cdb_assert(clone);
+	*clone = NULL;
+	if (cdb->error || !(cdb->opened))
+		return CDB_ERROR_E;
+	if (cdb->create)
+		return CDB_ERROR_MODE_E;
+	if (!(cdb->memory) && !(cdb->ops.read_at))
+		return CDB_ERROR_DISABLED_E;
+	cdb_t *c = cdb->ops.allocator(cdb->ops.arena, NULL, 0, sizeof *c);
+	if (!c)
+		return CDB_ERROR_ALLOCATE_E;
+	memcpy(c, cdb, sizeof *c);
+	c->clone    = 1;
+	c->sought   = 0;
+	c->position = 0;
+	c->buffer   = NULL; /* read ahead buffers are per handle */
+	c->ahead_length = 0;
+	memset(&c->stats, 0, sizeof (c->stats));
+	*clone      = c;
+	return CDB_OK_E;
+}
+
+/* returns: -1 = error, 0 = not equal, 1 = equal */
 static int cdb_compare(cdb_t *cdb, const cdb_buffer_t *k1, const cdb_file_pos_t *k2) {
 	cdb_assert(cdb);
 	cdb_assert(cdb->ops.compare);
@@ -569,6 +1438,14 @@ static int cdb_compare(cdb_t *cdb, const cdb_buffer_t *k1, const cdb_file_pos_t
 	if (k1->length != k2->length)
 		return CDB_NOT_FOUND_E; /* not equal */
 	const cdb_word_t length = k1->length;
+	const int equal = cdb->ops.compare == cdb_memory_compare; /* default is an equality test, not an ordering */
+	if (cdb->memory) { /* no need to copy anything */
+		if (cdb_bound_check(cdb, (k2->position + length) > cdb->length) < 0)
+			return CDB_ERROR_E;
+		if (equal)
+			return cdb_key_equal((const uint8_t *)k1->buffer, cdb->memory + k2->position, length);
+		return cdb->ops.compare(k1->buffer, cdb->memory + k2->position, length) ? CDB_NOT_FOUND_E : CDB_FOUND_E;
+	}
 	if (cdb_seek_internal(cdb, k2->position) < 0)
 		return CDB_ERROR_E;
 	for (cdb_word_t i = 0; i < length; i += CDB_READ_BUFFER_LENGTH) {
@@ -580,13 +1457,226 @@ static int cdb_compare(cdb_t *cdb, const cdb_buffer_t *k1, const cdb_file_pos_t
 		const cdb_word_t rl = CDB_MIN((cdb_word_t)sizeof kbuf, (cdb_word_t)length - i);
 		if (cdb_read_internal(cdb, kbuf, rl) != rl)
 			return CDB_ERROR_E;
-		if (cdb->ops.compare(k1->buffer + i, kbuf, rl))
+		if (equal ? !cdb_key_equal((const uint8_t *)k1->buffer + i, kbuf, rl) : cdb->ops.compare(k1->buffer + i, kbuf, rl) != 0)
 			return CDB_NOT_FOUND_E;
 	}
 	return CDB_FOUND_E; /* equal */
 }
 
-static int cdb_retrieve(cdb_t *cdb, const cdb_buffer_t *key, cdb_file_pos_t *value, uint64_t *record) {
+/* Find the position and length of a secondary hash table given a hash */
+static int cdb_bucket(cdb_t *cdb, const cdb_word_t h, cdb_word_t *pos, cdb_word_t *num) {
+	cdb_assert(cdb);
+	cdb_assert(pos);
+	cdb_assert(num);
+	if (cdb->index) { /* use more memory (~4KiB) to speed up first match */
+		*pos = cdb->index[h % CDB_BUCKETS].position;
+		*num = cdb->index[h % CDB_BUCKETS].length;
+	} else {
+		if (cdb_seek_internal(cdb, cdb->file_start + ((h % CDB_BUCKETS) * (2ul * cdb_get_size(cdb)))) < 0)
+			return CDB_ERROR_E;
+		if (cdb_read_word_pair(cdb, pos, num) < 0)
+			return CDB_ERROR_E;
+	}
+	if (*num == 0)
+		return cdb_failure(cdb);
+	return cdb_bound_check(cdb, *pos > cdb->file_end || *pos < cdb->hash_start);
+}
+
+typedef struct {
+	cdb_word_t table;   /* position of secondary hash table */
+	cdb_word_t slots;   /* number of slots in secondary hash table */
+	cdb_word_t start;   /* first slot to look at */
+	cdb_word_t visited; /* number of slots fetched so far */
+	cdb_word_t hash;    /* hash of key we are looking for */
+	const uint8_t *run; /* current run of slots, in 'buffer', the mapping or 'cdb->tables' */
+	size_t length, at;  /* number of slots in 'run', and next slot in 'run' to scan */
+	uint8_t buffer[CDB_PROBE_LENGTH * 2ul * sizeof (cdb_word_t)];
+} cdb_probe_t; /* state for a probe of a secondary hash table */
+
+#define CDB_PROBE_SCAN(TYPE) do {\
+	TYPE want = 0, empty = 0;\
+	memcpy(&want, t, sizeof want);\
+	for (size_t i = 0; i < n; i++) {\
+		TYPE hash = 0, position = 0;\
+		memcpy(&hash, b + (i * 2ul * sizeof hash), sizeof hash);\
+		memcpy(&position, b + (((i * 2ul) + 1ul) * sizeof position), sizeof position);\
+		if (hash == want || position == empty || b[i * 2ul * sizeof hash] != t[0])\
+			return i;\
+	}\
+} while (0)
+
+/* Find the first of "n" slots in "b" that needs a closer look, which is one
+ * that has a hash equal to "h", is empty (end of the list), or is in the
+ * wrong bucket (a corrupt database). Returns "n" if there is no such slot.
+ * The target hash is packed instead of unpacking every slot, this means a
+ * slot can be compared as a single native word regardless of endianess, and
+ * the loops are simple enough for the compiler to unroll or vectorize. */
+static size_t cdb_probe_scan(const uint8_t *b, const size_t n, const size_t l, const cdb_word_t h) {
+	cdb_assert(b);
+	uint8_t t[sizeof (cdb_word_t)] = { 0, };
+	cdb_pack(t, h, l);
+	switch (l) {
+	case 16/CHAR_BIT: CDB_PROBE_SCAN(uint16_t); break;
+	case 32/CHAR_BIT: CDB_PROBE_SCAN(uint32_t); break;
+	case 64/CHAR_BIT: CDB_PROBE_SCAN(uint64_t); break;
+	default: cdb_assert(0); return 0;
+	}
+	return n;
+}
+
+static void cdb_probe_init(cdb_probe_t *p, const cdb_word_t table, const cdb_word_t slots, const cdb_word_t hash) {
+	cdb_assert(p);
+	p->table   = table;
+	p->slots   = slots;
+	p->start   = slots ? (hash >> CDB_NBUCKETS) % slots : 0;
+	p->visited = 0;
+	p->hash    = hash;
+	p->run     = NULL;
+	p->length  = 0;
+	p->at      = 0;
+}
+
+/* Get the next run of slots, which are contiguous up until the end of the
+ * table, where we wrap around. There is no need to copy if the slots are
+ * already in memory. */
+static int cdb_probe_fetch(cdb_t *cdb, cdb_probe_t *p) {
+	cdb_assert(cdb);
+	cdb_assert(p);
+	cdb_assert(p->visited < p->slots);
+	const size_t w = 2ul * cdb_get_size(cdb);
+	const cdb_word_t index = (p->start + p->visited) % p->slots;
+	const cdb_word_t run = CDB_MIN(CDB_MIN(p->slots - index, p->slots - p->visited), (cdb_word_t)CDB_PROBE_LENGTH);
+	const cdb_word_t position = p->table + (index * w), length = run * w;
+	if (cdb_overflow_check(cdb, position < p->table || (position + length) < position) < 0)
+		return CDB_ERROR_E;
+	if (cdb_bound_check(cdb, position < cdb->hash_start || (position + length) > cdb->file_end) < 0)
+		return CDB_ERROR_E;
+	if (cdb->tables) {
+		p->run = cdb->tables + (position - cdb->hash_start);
+	} else if (cdb->memory) {
+		p->run = cdb->memory + position;
+	} else {
+		if (cdb_seek_internal(cdb, position) < 0)
+			return CDB_ERROR_E;
+		if (cdb_read_internal(cdb, p->buffer, length) != length)
+			return cdb_error(cdb, CDB_ERROR_READ_E);
+		p->run = p->buffer;
+	}
+	p->visited += run;
+	p->length = run;
+	p->at = 0;
+	return CDB_OK_E;
+}
+
+/* Find the next record with a matching hash in a secondary hash table,
+ * the record itself is not looked at. Returns 1 and sets "position" if
+ * found, 0 if there are no more candidates and negative on error. */
+static int cdb_probe_next(cdb_t *cdb, cdb_probe_t *p, cdb_word_t *position) {
+	cdb_assert(cdb);
+	cdb_assert(p);
+	cdb_assert(position);
+	const size_t l = cdb_get_size(cdb), w = 2ul * l;
+	*position = 0;
+	for (;;) {
+		if (p->at >= p->length) {
+			if (p->visited >= p->slots)
+				return CDB_NOT_FOUND_E;
+			if (cdb_probe_fetch(cdb, p) < 0)
+				return CDB_ERROR_E;
+		}
+		const size_t left = p->length - p->at, at = cdb_probe_scan(p->run + (p->at * w), left, l, p->hash);
+		p->at += at;
+		CDB_STAT(cdb, probes += CDB_MIN(at + 1ul, left)); /* the slot stopped at is looked at too */
+		if (p->at >= p->length)
+			continue;
+		const uint8_t *slot = p->run + (p->at++ * w);
+		const cdb_word_t h1 = cdb_unpack(slot, l), p1 = cdb_unpack(slot + l, l);
+		if (cdb_bound_check(cdb, p1 > cdb->hash_start) < 0) /* key-value pair should not overlap with hash tables section */
+			return CDB_ERROR_E;
+		if (p1 == 0) { /* end of list */
+			p->visited = p->slots;
+			p->length  = 0;
+			return CDB_NOT_FOUND_E;
+		}
+		if (cdb_hash_check(cdb, (h1 & 0xFFul) != (p->hash & 0xFFul)) < 0) /* buckets bits should be the same */
+			return CDB_ERROR_E;
+		cdb_assert(h1 == p->hash);
+		*position = p1;
+		return CDB_FOUND_E;
+	}
+}
+
+/* Read the key-value pair header at "position", only the key is bounds checked */
+static int cdb_record(cdb_t *cdb, const cdb_word_t position, cdb_file_pos_t *key, cdb_file_pos_t *value) {
+	cdb_assert(cdb);
+	cdb_assert(key);
+	cdb_assert(value);
+	if (cdb_seek_internal(cdb, position) < 0)
+		return CDB_ERROR_E;
+	cdb_word_t klen = 0, vlen = 0;
+	if (cdb_read_word_pair(cdb, &klen, &vlen) < 0)
+		return CDB_ERROR_E;
+	key->length     = klen;
+	key->position   = position + (2ul * cdb_get_size(cdb));
+	value->length   = vlen;
+	value->position = key->position + klen;
+	if (cdb_overflow_check(cdb, key->position < position || (key->position + klen) < key->position) < 0)
+		return CDB_ERROR_E;
+	return cdb_bound_check(cdb, key->position + klen > cdb->hash_start);
+}
+
+static int cdb_value_check(cdb_t *cdb, const cdb_file_pos_t *value) {
+	cdb_assert(cdb);
+	cdb_assert(value);
+	if (cdb_overflow_check(cdb, (value->position + value->length) < value->position) < 0)
+		return CDB_ERROR_E;
+	if (cdb_bound_check(cdb, value->position > cdb->hash_start) < 0)
+		return CDB_ERROR_E;
+	return cdb_bound_check(cdb, (value->position + value->length) > cdb->hash_start);
+}
+
+/* The cache is a table of (hash, record position) pairs that is shared by
+ * a handle and its clones, which may be on different threads, so it can
+ * change under us at any time. Each word is read and written atomically,
+ * but a pair may be torn. That does not matter as the database does not
+ * change, so the key at the record is always compared and a mismatch is
+ * simply a miss. A slot is empty if its position is zero. */
+static inline cdb_word_t *cdb_cache_slot(cdb_t *cdb, const cdb_word_t h) {
+	cdb_assert(cdb);
+	cdb_assert(cdb->cache);
+	return &cdb->cache[2ul * ((h >> CDB_NBUCKETS) % cdb->ops.cache)];
+}
+
+static inline void cdb_cache_put(cdb_word_t *slot, const cdb_word_t h, const cdb_word_t position) {
+	cdb_assert(slot);
+	CDB_ATOMIC_STORE(&slot[0], h);
+	CDB_ATOMIC_STORE(&slot[1], position);
+}
+
+static int cdb_cache_get(cdb_t *cdb, const cdb_word_t *slot, const cdb_word_t h, const cdb_buffer_t *key, cdb_file_pos_t *value) {
+	cdb_assert(cdb);
+	cdb_assert(slot);
+	cdb_assert(key);
+	cdb_assert(value);
+	const cdb_word_t sh = CDB_ATOMIC_LOAD(&slot[0]);
+	const cdb_word_t sp = CDB_ATOMIC_LOAD(&slot[1]);
+	if (sh != h || sp == 0)
+		return CDB_NOT_FOUND_E;
+	cdb_file_pos_t k = { 0, 0, }, v = { 0, 0, };
+	if (cdb_bound_check(cdb, sp < cdb->file_start || sp >= cdb->hash_start) < 0)
+		return CDB_ERROR_E;
+	if (cdb_record(cdb, sp, &k, &v) < 0)
+		return CDB_ERROR_E;
+	const int comp = cdb_compare(cdb, key, &k); /* a different key is just a miss, the probe loop counts collisions */
+	if (comp <= 0)
+		return comp;
+	if (cdb_value_check(cdb, &v) < 0)
+		return CDB_ERROR_E;
+	*value = v;
+	return CDB_FOUND_E;
+}
+
+static int cdb_find(cdb_t *cdb, const cdb_buffer_t *key, cdb_file_pos_t *value, uint64_t *record) {
 	cdb_assert(cdb);
 	cdb_assert(cdb->opened);
 	cdb_assert(cdb->ops.hash);
@@ -606,67 +1696,52 @@ static int cdb_retrieve(cdb_t *cdb, const cdb_buffer_t *key, cdb_file_pos_t *val
 	/* It is usually a good idea to include the length as part of the data
 	 * of the hash, however that would make the format incompatible. */
 	h = cdb->ops.hash((uint8_t *)(key->buffer), key->length) & cdb_get_mask(cdb); /* locate key in first table */
-	if (CDB_MEMORY_INDEX_ON) { /* use more memory (~4KiB) to speed up first match */
-		cdb_hash_table_t *t = &cdb->table1[h % CDB_BUCKETS];
-		pos = t->header.position;
-		num = t->header.length;
-	} else {
-		if (cdb_seek_internal(cdb, cdb->file_start + ((h % CDB_BUCKETS) * (2ul * cdb_get_size(cdb)))) < 0)
-			goto fail;
-		if (cdb_read_word_pair(cdb, &pos, &num) < 0)
+	if (cdb->filter && !cdb_filter_test(cdb, h)) /* most misses end here without any reads */
+		return cdb_failure(cdb) < 0 ? CDB_ERROR_E : CDB_NOT_FOUND_E;
+	cdb_word_t *slot = NULL;
+	if (cdb->cache && wanted == 0) { /* hot keys skip the hash tables */
+		slot = cdb_cache_slot(cdb, h);
+		const int r = cdb_cache_get(cdb, slot, h, key, value);
+		if (r < 0)
 			goto fail;
+		if (r > 0) {
+			cdb->stats.hits++;
+			return cdb_failure(cdb) < 0 ? CDB_ERROR_E : CDB_FOUND_E;
+		}
+		cdb->stats.misses++;
 	}
+	if (cdb_bucket(cdb, h, &pos, &num) < 0)
+		goto fail;
 	if (num == 0) /* no keys in this bucket -> key not found */
 		return cdb_failure(cdb) < 0 ? CDB_ERROR_E : CDB_NOT_FOUND_E;
-	if (cdb_bound_check(cdb, pos > cdb->file_end || pos < cdb->hash_start) < 0)
-		goto fail;
-	const cdb_word_t start = (h >> CDB_NBUCKETS) % num;
-	for (cdb_word_t i = 0; i < num; i++) {
-		const cdb_word_t seekpos = pos + (((start + i) % num) * (2ul * cdb_get_size(cdb)));
-		if (seekpos < pos || seekpos > cdb->file_end)
-			goto fail;
-		if (cdb_seek_internal(cdb, seekpos) < 0)
-			goto fail;
-		cdb_word_t h1 = 0, p1 = 0;
-		if (cdb_read_word_pair(cdb, &h1, &p1) < 0)
+	cdb_probe_t probe;
+	cdb_probe_init(&probe, pos, num, h);
+	for (;;) { /* only records with a matching hash are looked at */
+		cdb_word_t p1 = 0;
+		const int r = cdb_probe_next(cdb, &probe, &p1);
+		if (r < 0)
 			goto fail;
-		if (cdb_bound_check(cdb, p1 > cdb->hash_start) < 0) /* key-value pair should not overlap with hash tables section */
+		if (r == CDB_NOT_FOUND_E)
+			break;
+		cdb_file_pos_t k2 = { 0, 0, }, v2 = { 0, 0, };
+		if (cdb_record(cdb, p1, &k2, &v2) < 0)
 			goto fail;
-		if (p1 == 0) { /* end of list */
-			*record         = recno;
-			return cdb_failure(cdb) < 0 ? CDB_ERROR_E : CDB_NOT_FOUND_E;
-		}
-		if (cdb_hash_check(cdb, (h1 & 0xFFul) != (h & 0xFFul)) < 0) /* buckets bits should be the same */
+		const int comp = cdb_compare(cdb, key, &k2);
+		const int found = comp > 0;
+		if (comp < 0)
 			goto fail;
-		if (h1 == h) { /* possible match */
-			if (cdb_seek_internal(cdb, p1) < 0)
-				goto fail;
-			cdb_word_t klen = 0, vlen = 0;
-			if (cdb_read_word_pair(cdb, &klen, &vlen) < 0)
+		if (comp == 0)
+			CDB_STAT(cdb, collisions++);
+		if (found && recno == wanted) { /* found key, correct record? */
+			if (cdb_value_check(cdb, &v2) < 0)
 				goto fail;
-			const cdb_file_pos_t k2 = { .length = klen, .position = p1 + (2ul * cdb_get_size(cdb)) };
-			if (cdb_overflow_check(cdb, k2.position < p1 || (k2.position + klen) < k2.position) < 0)
-				goto fail;
-			if (cdb_bound_check(cdb, k2.position + klen > cdb->hash_start) < 0)
-				goto fail;
-			const int comp = cdb_compare(cdb, key, &k2);
-			const int found = comp > 0;
-			if (comp < 0)
-				goto fail;
-			if (found && recno == wanted) { /* found key, correct record? */
-				cdb_file_pos_t v2 = { .length = vlen, .position = k2.position + klen };
-				if (cdb_overflow_check(cdb, (v2.position + v2.length) < v2.position) < 0)
-					goto fail;
-				if (cdb_bound_check(cdb, v2.position > cdb->hash_start) < 0)
-					goto fail;
-				if (cdb_bound_check(cdb, (v2.position + v2.length) > cdb->hash_start) < 0)
-					goto fail;
-				*value          = v2;
-				*record         = recno;
-				return cdb_failure(cdb) < 0 ? CDB_ERROR_E : CDB_FOUND_E;
-			}
-			recno += found;
+			*value          = v2;
+			*record         = recno;
+			if (slot)
+				cdb_cache_put(slot, h, p1);
+			return cdb_failure(cdb) < 0 ? CDB_ERROR_E : CDB_FOUND_E;
 		}
+		recno += found;
 	}
 	*record         = recno;
 	return cdb_failure(cdb) < 0 ? CDB_ERROR_E : CDB_NOT_FOUND_E;
@@ -674,6 +1749,28 @@ fail:
 	return cdb_error(cdb, CDB_ERROR_E);
 }
 
+/* Count a lookup that looked at "probes" slots and took "ticks", only called if CDB_STATS_ON is set */
+static void cdb_stats_lookup(cdb_t *cdb, const int found, const uint64_t probes, const uint64_t ticks) {
+	cdb_assert(cdb);
+	cdb->stats.lookups++;
+	cdb->stats.found += !!found;
+	cdb->stats.probes_max = CDB_MAX(cdb->stats.probes_max, probes);
+	cdb->stats.probe_histogram[cdb_stats_bucket(probes)]++;
+	if (cdb->ops.ticks)
+		cdb->stats.latency_histogram[cdb_stats_bucket(ticks)]++;
+}
+
+/* "cdb_find", counting and timing it if CDB_STATS_ON is set */
+static int cdb_retrieve(cdb_t *cdb, const cdb_buffer_t *key, cdb_file_pos_t *value, uint64_t *record) {
+	cdb_assert(cdb);
+	if (!CDB_STATS_ON)
+		return cdb_find(cdb, key, value, record);
+	const uint64_t probes = cdb->stats.probes, start = cdb->ops.ticks ? cdb->ops.ticks() : 0;
+	const int r = cdb_find(cdb, key, value, record);
+	cdb_stats_lookup(cdb, r == CDB_FOUND_E, cdb->stats.probes - probes, cdb->ops.ticks ? cdb->ops.ticks() - start : 0);
+	return r;
+}
+
 int cdb_lookup(cdb_t *cdb, const cdb_buffer_t *key, cdb_file_pos_t *value, uint64_t record) {
 	cdb_assert(cdb);
 	cdb_assert(cdb->opened);
@@ -682,6 +1779,196 @@ int cdb_lookup(cdb_t *cdb, const cdb_buffer_t *key, cdb_file_pos_t *value, uint6
 	return cdb_retrieve(cdb, key, value, &record);
 }
 
+typedef struct {
+	cdb_word_t hash;     /* hash of key */
+	cdb_word_t order;    /* what we are currently sorting on, a file position */
+	cdb_word_t position; /* position of first record with a matching hash, if any */
+	uint64_t probes;     /* slots looked at for this key, only kept if CDB_STATS_ON is set */
+	size_t index;        /* index of key and value */
+} cdb_batch_t; /* per key state for "cdb_lookup_batch" */
+
+static inline int cdb_batch_less(const cdb_batch_t *a, const cdb_batch_t *b) {
+	cdb_assert(a);
+	cdb_assert(b);
+	return a->order < b->order || (a->order == b->order && a->index < b->index);
+}
+
+static void cdb_batch_sift(cdb_batch_t *b, size_t root, const size_t length) {
+	cdb_assert(b);
+	for (size_t child = 0; (child = (2ul * root) + 1ul) < length; root = child) {
+		if ((child + 1ul) < length && cdb_batch_less(&b[child], &b[child + 1ul]))
+			child++;
+		if (!cdb_batch_less(&b[root], &b[child]))
+			return;
+		const cdb_batch_t t = b[root];
+		b[root] = b[child];
+		b[child] = t;
+	}
+}
+
+/* Heap sort: no recursion, allocation or dependency on "qsort" */
+static void cdb_batch_sort(cdb_batch_t *b, const size_t length) {
+	cdb_assert(b);
+	for (size_t i = length / 2ul; i > 0; i--)
+		cdb_batch_sift(b, i - 1ul, length);
+	for (size_t i = length; i > 1; i--) {
+		const cdb_batch_t t = b[0];
+		b[0] = b[i - 1ul];
+		b[i - 1ul] = t;
+		cdb_batch_sift(b, 0, i - 1ul);
+	}
+}
+
+/* Looking up many keys at once allows us to reorder the reads so that we
+ * mostly move forward through the file; first we visit each initial hash
+ * table bucket once, then we probe the secondary hash tables in file order,
+ * and then we compare keys in file order. Only the first record whose hash
+ * matches is looked at in the final step, if the key does not match (a hash
+ * collision, which should be rare) we fall back to a normal lookup. Each key
+ * is counted as a lookup, taking an equal share of the time of the batch. */
+int cdb_lookup_batch(cdb_t *cdb, const cdb_buffer_t *keys, cdb_file_pos_t *values, const size_t count) {
+	cdb_preconditions(cdb);
+	cdb_assert(cdb->opened);
+	cdb_assert(cdb->ops.hash);
+	cdb_implies(count, keys);
+	cdb_implies(count, values);
+	const size_t l = cdb_get_size(cdb);
+	const int mapped = cdb->memory != NULL;
+	cdb_batch_t *b = NULL;
+	int found = 0;
+	size_t m = 0; /* number of keys not found in the cache */
+	if (cdb->error)
+		goto fail;
+	if (cdb->create) {
+		(void)cdb_error(cdb, CDB_ERROR_MODE_E);
+		goto fail;
+	}
+	if (count == 0)
+		return CDB_OK_E;
+	const uint64_t start = CDB_STATS_ON && cdb->ops.ticks ? cdb->ops.ticks() : 0;
+	if (cdb_overflow_check(cdb, (count * sizeof *b) / sizeof *b != count) < 0)
+		goto fail;
+	if (!(b = cdb_allocate(cdb, count * sizeof *b)))
+		goto fail;
+
+	for (size_t i = 0; i < count; i++) {
+		const cdb_word_t h = cdb->ops.hash((uint8_t *)(keys[i].buffer), keys[i].length) & cdb_get_mask(cdb);
+		values[i]  = (cdb_file_pos_t) { 0, 0, };
+		if (cdb->filter && !cdb_filter_test(cdb, h))
+			continue;
+		if (cdb->cache) {
+			const int r = cdb_cache_get(cdb, cdb_cache_slot(cdb, h), h, &keys[i], &values[i]);
+			if (r < 0)
+				goto fail;
+			if (r > 0) {
+				cdb->stats.hits++;
+				found++;
+				continue;
+			}
+			cdb->stats.misses++;
+		}
+		b[m].hash   = h;
+		b[m].order  = h % CDB_BUCKETS;
+		b[m].probes = 0;
+		b[m].index  = i;
+		m++;
+	}
+	const size_t cached = found; /* keys found in the cache, the rest not probed were ruled out by the filter */
+	cdb_batch_sort(b, m);
+
+	cdb_word_t pos = 0, num = 0;
+	cdb_probe_t probe;
+	for (size_t i = 0; i < m; i++) { /* visit initial table in order */
+		if (i == 0 || (b[i].hash % CDB_BUCKETS) != (b[i - 1ul].hash % CDB_BUCKETS))
+			if (cdb_bucket(cdb, b[i].hash, &pos, &num) < 0)
+				goto fail;
+		b[i].order = num ? pos + (((b[i].hash >> CDB_NBUCKETS) % num) * (2ul * l)) : 0;
+		b[i].position = num; /* temporarily store number of slots */
+	}
+	cdb_batch_sort(b, m);
+
+	for (size_t i = 0; i < m; i++) { /* probe secondary tables in order */
+		const cdb_word_t slots = b[i].position, first = b[i].order;
+		b[i].position = 0;
+		if (mapped && (i + 1ul) < m && b[i + 1ul].order)
+			CDB_PREFETCH(cdb->memory + b[i + 1ul].order);
+		if (slots == 0)
+			continue;
+		const cdb_word_t table = first - (((b[i].hash >> CDB_NBUCKETS) % slots) * (2ul * l));
+		cdb_probe_init(&probe, table, slots, b[i].hash);
+		const uint64_t probes = cdb->stats.probes;
+		if (cdb_probe_next(cdb, &probe, &b[i].position) < 0)
+			goto fail;
+		b[i].probes = cdb->stats.probes - probes;
+		b[i].order = b[i].position;
+	}
+	cdb_batch_sort(b, m);
+
+	for (size_t i = 0; i < m; i++) { /* compare keys in order */
+		if (b[i].position == 0)
+			continue;
+		if (mapped && (i + 1ul) < m)
+			CDB_PREFETCH(cdb->memory + b[i + 1ul].position);
+		const size_t idx = b[i].index;
+		cdb_file_pos_t k2 = { 0, 0, }, v2 = { 0, 0, };
+		if (cdb_record(cdb, b[i].position, &k2, &v2) < 0)
+			goto fail;
+		const int comp = cdb_compare(cdb, &keys[idx], &k2);
+		if (comp < 0)
+			goto fail;
+		if (comp == 0) { /* collision: do it the slow way */
+			uint64_t record = 0;
+			const uint64_t probes = cdb->stats.probes;
+			const int r = cdb_find(cdb, &keys[idx], &values[idx], &record);
+			if (r < 0)
+				goto fail;
+			b[i].probes += cdb->stats.probes - probes;
+			found += r == CDB_FOUND_E;
+			continue;
+		}
+		if (cdb_value_check(cdb, &v2) < 0)
+			goto fail;
+		values[idx] = v2;
+		if (cdb->cache)
+			cdb_cache_put(cdb_cache_slot(cdb, b[i].hash), b[i].hash, b[i].position);
+		found++;
+	}
+	if (CDB_STATS_ON) {
+		const uint64_t each = cdb->ops.ticks ? (cdb->ops.ticks() - start) / count : 0;
+		for (size_t i = 0; i < m; i++)
+			cdb_stats_lookup(cdb, values[b[i].index].position != 0, b[i].probes, each);
+		for (size_t i = m; i < count; i++)
+			cdb_stats_lookup(cdb, (i - m) < cached, 0, each);
+	}
+	(void)cdb_free(cdb, b);
+	return cdb_failure(cdb) < 0 ? CDB_ERROR_E : found;
+fail:
+	(void)cdb_free(cdb, b);
+	return cdb_error(cdb, CDB_ERROR_E);
+}
+
+int cdb_pointer(cdb_t *cdb, const cdb_file_pos_t *fp, const void **pointer) {
+	cdb_preconditions(cdb);
+	cdb_assert(fp);
+	cdb_assert(pointer);
+	*pointer = NULL;
+	if (cdb_error(cdb, cdb->create != 0 ? CDB_ERROR_MODE_E : 0))
+		return CDB_ERROR_E;
+	if (cdb->ahead_length && fp->position >= cdb->ahead && (fp->position + fp->length) >= fp->position
+			&& (fp->position + fp->length) <= (cdb->ahead + cdb->ahead_length)) { /* within "cdb_foreach" */
+		*pointer = cdb->buffer + (fp->position - cdb->ahead);
+		return CDB_FOUND_E;
+	}
+	if (!(cdb->memory))
+		return CDB_OK_E;
+	if (cdb_overflow_check(cdb, (fp->position + fp->length) < fp->position) < 0)
+		return CDB_ERROR_E;
+	if (cdb_bound_check(cdb, fp->position < cdb->file_start || (fp->position + fp->length) > cdb->file_end) < 0)
+		return CDB_ERROR_E;
+	*pointer = cdb->memory + fp->position;
+	return CDB_FOUND_E;
+}
+
 int cdb_get(cdb_t *cdb, const cdb_buffer_t *key, cdb_file_pos_t *value) {
 	cdb_assert(cdb);
 	cdb_assert(cdb->opened);
@@ -690,6 +1977,219 @@ int cdb_get(cdb_t *cdb, const cdb_buffer_t *key, cdb_file_pos_t *value) {
 	return cdb_lookup(cdb, key, value, 0l);
 }
 
+enum { CDB_ASYNC_HEADER, CDB_ASYNC_SLOTS, CDB_ASYNC_RECORD, CDB_ASYNC_KEY, CDB_ASYNC_DONE, };
+
+/* Work out what the current state of a lookup needs from the database */
+static int cdb_async_need(cdb_t *cdb, cdb_async_t *a, cdb_word_t *position, cdb_word_t *length) {
+	cdb_assert(cdb);
+	cdb_assert(a);
+	cdb_assert(position);
+	cdb_assert(length);
+	const size_t w = 2ul * cdb_get_size(cdb);
+	switch (a->state) {
+	case CDB_ASYNC_HEADER:
+		*position = cdb->file_start + ((a->hash % CDB_BUCKETS) * w);
+		*length   = w;
+		return CDB_OK_E;
+	case CDB_ASYNC_SLOTS: { /* a run of slots, up until the end of the table where we wrap around */
+		const cdb_word_t index = (a->start + a->visited) % a->slots;
+		a->run    = CDB_MIN(CDB_MIN(a->slots - index, a->slots - a->visited), (cdb_word_t)(sizeof (a->buffer) / w));
+		*position = a->table + (index * w);
+		*length   = a->run * w;
+		if (cdb_overflow_check(cdb, *position < a->table || (*position + *length) < *position) < 0)
+			return CDB_ERROR_E;
+		return cdb_bound_check(cdb, *position < cdb->hash_start || (*position + *length) > cdb->file_end);
+	}
+	case CDB_ASYNC_RECORD: /* the record header and as much of the key as will fit */
+		*position = a->candidate;
+		*length   = CDB_MIN(CDB_MIN(w + a->key->length, (cdb_word_t)sizeof (a->buffer)), cdb->hash_start - a->candidate);
+		return cdb_bound_check(cdb, *length < w);
+	case CDB_ASYNC_KEY:
+		*position = a->candidate + w + a->compared;
+		*length   = CDB_MIN(a->key->length - a->compared, (cdb_word_t)sizeof (a->buffer));
+		return CDB_OK_E;
+	}
+	cdb_assert(0);
+	return cdb_error(cdb, CDB_ERROR_E);
+}
+
+static inline int cdb_async_done(cdb_async_t *a, const int found) {
+	cdb_assert(a);
+	a->state  = CDB_ASYNC_DONE;
+	a->length = 0;
+	if (found != CDB_FOUND_E)
+		a->value = (cdb_file_pos_t) { 0, 0, };
+	return found;
+}
+
+/* Compare the next "length" bytes of the key against "data" */
+static int cdb_async_compare(cdb_t *cdb, cdb_async_t *a, const uint8_t *data, const cdb_word_t length) {
+	cdb_assert(cdb);
+	cdb_assert(a);
+	cdb_assert(data);
+	const char *k = a->key->buffer + a->compared;
+	a->compared += length;
+	if (cdb->ops.compare == cdb_memory_compare)
+		return cdb_key_equal((const uint8_t *)k, data, length);
+	return cdb->ops.compare(k, data, length) == 0;
+}
+
+/* The same steps as "cdb_retrieve", but whenever something is needed that
+ * is not in memory the read is described in "a" and we return, carrying on
+ * from the same state when the caller has done it. "data" is what the
+ * current state needs, or NULL if it has not been fetched yet. Nothing here
+ * seeks, so many lookups can be in flight on one handle. */
+static int cdb_async_run(cdb_t *cdb, cdb_async_t *a, const uint8_t *data) {
+	cdb_assert(cdb);
+	cdb_assert(a);
+	const size_t l = cdb_get_size(cdb), w = 2ul * l;
+	for (a->length = 0;;) {
+		if (cdb->error)
+			return CDB_ERROR_E;
+		if (!data && a->state == CDB_ASYNC_HEADER && cdb->index) { /* no need to read anything */
+			cdb_pack(a->buffer,     cdb->index[a->hash % CDB_BUCKETS].position, l);
+			cdb_pack(a->buffer + l, cdb->index[a->hash % CDB_BUCKETS].length,   l);
+			data = a->buffer;
+		}
+		cdb_word_t position = 0, length = 0;
+		if (cdb_async_need(cdb, a, &position, &length) < 0)
+			return CDB_ERROR_E;
+		if (!data) {
+			if (a->state == CDB_ASYNC_SLOTS && cdb->tables) {
+				data = cdb->tables + (position - cdb->hash_start);
+			} else if (cdb->memory) {
+				if (cdb_bound_check(cdb, ((uint64_t)position + length) > cdb->length) < 0)
+					return CDB_ERROR_E;
+				data = cdb->memory + position;
+			} else {
+				a->file   = cdb->file;
+				a->offset = (uint64_t)position + cdb->ops.offset;
+				a->length = length;
+				return CDB_ASYNC_READ;
+			}
+		}
+		int match = 0;
+		switch (a->state) {
+		case CDB_ASYNC_HEADER: {
+			const cdb_word_t pos = cdb_unpack(data, l), num = cdb_unpack(data + l, l);
+			if (num == 0)
+				return cdb_async_done(a, CDB_NOT_FOUND_E);
+			if (cdb_bound_check(cdb, pos > cdb->file_end || pos < cdb->hash_start) < 0)
+				return CDB_ERROR_E;
+			a->table   = pos;
+			a->slots   = num;
+			a->start   = (a->hash >> CDB_NBUCKETS) % num;
+			a->visited = 0;
+			a->state   = CDB_ASYNC_SLOTS;
+			break;
+		}
+		case CDB_ASYNC_SLOTS: {
+			const size_t at = cdb_probe_scan(data, a->run, l, a->hash);
+			if (at >= a->run) {
+				a->visited += a->run;
+				break;
+			}
+			const cdb_word_t h1 = cdb_unpack(data + (at * w), l), p1 = cdb_unpack(data + (at * w) + l, l);
+			if (cdb_bound_check(cdb, p1 > cdb->hash_start) < 0)
+				return CDB_ERROR_E;
+			if (p1 == 0) /* end of list */
+				return cdb_async_done(a, CDB_NOT_FOUND_E);
+			if (cdb_hash_check(cdb, (h1 & 0xFFul) != (a->hash & 0xFFul)) < 0)
+				return CDB_ERROR_E;
+			a->visited  += at + 1ul; /* the rest of the run is fetched again if this is not the one */
+			a->candidate = p1;
+			a->state     = CDB_ASYNC_RECORD;
+			break;
+		}
+		case CDB_ASYNC_RECORD: {
+			const cdb_word_t klen = cdb_unpack(data, l), vlen = cdb_unpack(data + l, l);
+			const cdb_word_t kpos = a->candidate + w;
+			if (cdb_overflow_check(cdb, kpos < a->candidate || (kpos + klen) < kpos) < 0)
+				return CDB_ERROR_E;
+			if (cdb_bound_check(cdb, (kpos + klen) > cdb->hash_start) < 0)
+				return CDB_ERROR_E;
+			a->state = CDB_ASYNC_SLOTS;
+			if (klen != a->key->length)
+				break;
+			a->value    = (cdb_file_pos_t) { .position = kpos + klen, .length = vlen, };
+			a->compared = 0;
+			if (!cdb_async_compare(cdb, a, data + w, CDB_MIN(klen, length - w)))
+				break;
+			match = a->compared == klen;
+			a->state = match ? CDB_ASYNC_SLOTS : CDB_ASYNC_KEY;
+			break;
+		}
+		case CDB_ASYNC_KEY:
+			a->state = CDB_ASYNC_SLOTS;
+			if (!cdb_async_compare(cdb, a, data, length))
+				break;
+			match = a->compared == a->key->length;
+			a->state = match ? CDB_ASYNC_SLOTS : CDB_ASYNC_KEY;
+			break;
+		default:
+			cdb_assert(0);
+			return cdb_error(cdb, CDB_ERROR_E);
+		}
+		data = NULL;
+		if (match && a->recno++ == a->record) { /* found key, correct record? */
+			if (cdb_value_check(cdb, &a->value) < 0)
+				return CDB_ERROR_E;
+			return cdb_async_done(a, CDB_FOUND_E);
+		}
+		if (a->state == CDB_ASYNC_SLOTS && a->visited >= a->slots)
+			return cdb_async_done(a, CDB_NOT_FOUND_E);
+	}
+}
+
+int cdb_async_start(cdb_t *cdb, cdb_async_t *a, const cdb_buffer_t *key, const uint64_t record) {
+	cdb_preconditions(cdb);
+	cdb_assert(cdb->opened);
+	cdb_assert(cdb->ops.hash);
+	cdb_assert(a);
+	cdb_assert(key);
+	CDB_BUILD_BUG_ON(CDB_ASYNC_BUFFER_LENGTH < (4ul * sizeof (cdb_word_t)));
+	*a = (cdb_async_t) { .key = key, .record = record, .state = CDB_ASYNC_HEADER, };
+	if (cdb->error)
+		return CDB_ERROR_E;
+	if (cdb->create)
+		return cdb_error(cdb, CDB_ERROR_MODE_E);
+	a->hash = cdb->ops.hash((uint8_t *)(key->buffer), key->length) & cdb_get_mask(cdb);
+	if (cdb->filter && !cdb_filter_test(cdb, a->hash))
+		return cdb_async_done(a, CDB_NOT_FOUND_E);
+	return cdb_async_run(cdb, a, NULL);
+}
+
+int cdb_async_step(cdb_t *cdb, cdb_async_t *a, const size_t length) {
+	cdb_preconditions(cdb);
+	cdb_assert(a);
+	cdb_assert(a->state != CDB_ASYNC_DONE);
+	cdb_assert(a->length);
+	if (cdb->error)
+		return CDB_ERROR_E;
+	if (length != a->length)
+		return cdb_error(cdb, CDB_ERROR_READ_E);
+	return cdb_async_run(cdb, a, a->buffer);
+}
+
+/* Without a filter only the initial hash table can be used, which rules out
+ * far fewer keys, but does at least not need to look at any records. */
+int cdb_may_contain(cdb_t *cdb, const cdb_buffer_t *key) {
+	cdb_preconditions(cdb);
+	cdb_assert(cdb->opened);
+	cdb_assert(key);
+	if (cdb->error)
+		return CDB_ERROR_E;
+	if (cdb->create)
+		return cdb_error(cdb, CDB_ERROR_MODE_E);
+	const cdb_word_t h = cdb->ops.hash((uint8_t *)(key->buffer), key->length) & cdb_get_mask(cdb);
+	if (cdb->filter)
+		return cdb_filter_test(cdb, h);
+	cdb_word_t pos = 0, num = 0;
+	if (cdb_bucket(cdb, h, &pos, &num) < 0)
+		return cdb_error(cdb, CDB_ERROR_E);
+	return num != 0;
+}
+
 int cdb_count(cdb_t *cdb, const cdb_buffer_t *key, uint64_t *count) {
 	cdb_assert(cdb);
 	cdb_assert(cdb->opened);
@@ -703,69 +2203,322 @@ int cdb_count(cdb_t *cdb, const cdb_buffer_t *key, uint64_t *count) {
 	return r;
 }
 
-int cdb_foreach(cdb_t *cdb, cdb_callback cb, void *param) {
+/* Make sure "length" bytes from "position" in the record area are in the
+ * read ahead buffer, returning a pointer to them, or NULL if they do not fit
+ * or on error. The buffer is refilled with one large read, which is much
+ * faster than seeking and reading for each record. */
+static const uint8_t *cdb_read_ahead(cdb_t *cdb, const cdb_word_t position, const cdb_word_t length) {
+	cdb_assert(cdb);
+	cdb_assert(cdb->buffer);
+	cdb_assert(position <= cdb->hash_start);
+	if (length > cdb->ops.buffer || length > (cdb->hash_start - position))
+		return NULL;
+	if (position >= cdb->ahead && (position + length) <= (cdb->ahead + cdb->ahead_length))
+		return cdb->buffer + (position - cdb->ahead);
+	const size_t n = CDB_MIN((cdb_word_t)cdb->ops.buffer, cdb->hash_start - position);
+	cdb->ahead_length = 0;
+	if (cdb_seek_internal(cdb, position) < 0 || cdb_read(cdb, cdb->buffer, n) < 0)
+		return NULL;
+	cdb->ahead = position;
+	cdb->ahead_length = n;
+	return cdb->buffer;
+}
+
+static inline cdb_word_t cdb_records_start(cdb_t *cdb) {
+	cdb_assert(cdb);
+	return cdb->file_start + (CDB_BUCKETS * 2ul * cdb_get_size(cdb));
+}
+
+int cdb_iter_init(cdb_t *cdb, cdb_iter_t *it) {
 	cdb_assert(cdb);
 	cdb_assert(cdb->opened);
-	if (cdb->error || cdb->create)
-		goto fail;
-	cdb_word_t pos = cdb->file_start + (256ul * (2ul * cdb_get_size(cdb)));
-	int r = 0;
-	for (;pos < cdb->hash_start;) {
+	cdb_assert(it);
+	it->position = 0;
+	it->end      = 0;
+	if (cdb->error || cdb_error(cdb, cdb->create != 0 ? CDB_ERROR_MODE_E : 0))
+		return CDB_ERROR_E;
+	it->position = cdb_records_start(cdb);
+	it->end      = cdb->hash_start;
+	return cdb_failure(cdb);
+}
+
+int cdb_iter_seek(cdb_t *cdb, cdb_iter_t *it, const cdb_word_t position) {
+	cdb_assert(cdb);
+	cdb_assert(cdb->opened);
+	cdb_assert(it);
+	if (cdb->error || cdb_error(cdb, cdb->create != 0 ? CDB_ERROR_MODE_E : 0))
+		return CDB_ERROR_E;
+	if (cdb_bound_check(cdb, position < cdb_records_start(cdb) || position > cdb->hash_start) < 0)
+		return CDB_ERROR_E;
+	it->position = position;
+	return cdb_failure(cdb);
+}
+
+/* The records are read in order, so unless the database is mapped they are
+ * read ahead in large blocks into a buffer that is kept until the handle is
+ * closed, or in the case of "cdb_foreach", until it returns. */
+int cdb_iter_next(cdb_t *cdb, cdb_iter_t *it, cdb_file_pos_t *key, cdb_file_pos_t *value) {
+	cdb_assert(cdb);
+	cdb_assert(cdb->opened);
+	cdb_assert(it);
+	cdb_assert(key);
+	cdb_assert(value);
+	if (cdb->error || cdb_error(cdb, cdb->create != 0 ? CDB_ERROR_MODE_E : 0))
+		return CDB_ERROR_E;
+	const size_t l = cdb_get_size(cdb), w = 2ul * l;
+	const cdb_word_t pos = it->position;
+	if (cdb_bound_check(cdb, pos < cdb_records_start(cdb) || it->end > cdb->hash_start) < 0)
+		return CDB_ERROR_E;
+	if (pos >= it->end)
+		return CDB_OK_E;
+	if (!(cdb->memory) && !(cdb->buffer) && cdb->ops.buffer >= w)
+		if (!(cdb->buffer = cdb_allocate(cdb, cdb->ops.buffer)))
+			return CDB_ERROR_E;
+	const uint8_t *a = cdb->buffer ? cdb_read_ahead(cdb, pos, w) : NULL;
+	cdb_word_t klen = 0, vlen = 0;
+	if (a) {
+		klen = cdb_unpack(a, l);
+		vlen = cdb_unpack(a + l, l);
+	} else {
 		if (cdb_seek_internal(cdb, pos) < 0)
-			goto fail;
-		cdb_word_t klen = 0, vlen = 0;
+			return CDB_ERROR_E;
 		if (cdb_read_word_pair(cdb, &klen, &vlen) < 0)
+			return CDB_ERROR_E;
+	}
+	key->length     = klen;
+	key->position   = pos + w;
+	value->length   = vlen;
+	value->position = pos + w + klen;
+	if (cdb_bound_check(cdb, value->position < key->position || value->position > cdb->hash_start) < 0)
+		return CDB_ERROR_E;
+	if (cdb_bound_check(cdb, value->length > (cdb->hash_start - value->position)) < 0) /* cannot overflow, unlike adding them */
+		return CDB_ERROR_E;
+	if (a) /* so "cdb_pointer" can find the key and value, if they fit */
+		(void)cdb_read_ahead(cdb, pos, w + klen + vlen);
+	if (cdb->error)
+		return CDB_ERROR_E;
+	it->position = value->position + value->length;
+	return CDB_FOUND_E;
+}
+
+int cdb_foreach_range(cdb_t *cdb, const cdb_word_t start, const cdb_word_t end, cdb_callback cb, void *param) {
+	cdb_assert(cdb);
+	cdb_assert(cdb->opened);
+	cdb_iter_t it = { .position = 0, .end = 0, };
+	int r = 0;
+	const int ahead = !(cdb->buffer); /* only free the read ahead buffer if we made it */
+	if (cdb_iter_init(cdb, &it) < 0 || cdb_iter_seek(cdb, &it, start) < 0)
+		goto fail;
+	if (cdb_bound_check(cdb, end > cdb->hash_start || start > end) < 0)
+		goto fail;
+	it.end = end;
+	for (;;) {
+		cdb_file_pos_t key = { 0, 0, }, value = { 0, 0, };
+		const int n = cdb_iter_next(cdb, &it, &key, &value);
+		if (n < 0)
 			goto fail;
-		const cdb_file_pos_t key   = { .length = klen, .position = pos + (2ul * cdb_get_size(cdb)), };
-		const cdb_file_pos_t value = { .length = vlen, .position = pos + (2ul * cdb_get_size(cdb)) + klen, };
-		if (cdb_bound_check(cdb, value.position > cdb->hash_start) < 0)
-			goto fail;
-		if (cdb_bound_check(cdb, (value.position + value.length) > cdb->hash_start) < 0)
-			goto fail;
+		if (n == 0)
+			break;
 		r = cb ? cb(cdb, &key, &value, param) : 0;
 		if (r < 0)
 			goto fail;
 		if (r > 0) /* early termination */
 			break;
-		pos = value.position + value.length;
+	}
+	if (ahead && cdb->buffer) {
+		cdb->ahead_length = 0;
+		const int f = cdb_free(cdb, cdb->buffer);
+		cdb->buffer = NULL;
+		if (f < 0)
+			goto fail;
 	}
 	return cdb_failure(cdb) < 0 ? CDB_ERROR_E : r;
 fail:
+	if (ahead && cdb->buffer) {
+		cdb->ahead_length = 0;
+		(void)cdb_free(cdb, cdb->buffer);
+		cdb->buffer = NULL;
+	}
 	return cdb_error(cdb, CDB_ERROR_E);
 }
 
-static int cdb_round_up_to_next_power_of_two(const cdb_word_t x) {
-	cdb_word_t p = 1ul;
-	while (p < x)
-		p <<= 1ul;
-	return p;
+int cdb_foreach(cdb_t *cdb, cdb_callback cb, void *param) {
+	cdb_assert(cdb);
+	return cdb_foreach_range(cdb, cdb_records_start(cdb), cdb->hash_start, cb, param);
+}
+
+/* Every record is pointed to by exactly one slot in the secondary hash
+ * tables, so the positions in them are all safe places to split the
+ * records up at. The buckets are filled at random, so only a sample of them
+ * needs to be looked at to find a position near where each range should
+ * start, for each sampled position the range it falls into keeps the
+ * lowest one, then each range takes the lowest of its own and those after
+ * it, as a range may not have had any positions fall into it. */
+int cdb_partition(cdb_t *cdb, cdb_word_t *boundaries, const size_t ranges) {
+	cdb_assert(cdb);
+	cdb_assert(cdb->opened);
+	cdb_assert(boundaries);
+	if (cdb->error || cdb->create || ranges == 0)
+		return cdb_error(cdb, CDB_ERROR_E);
+	const size_t l = cdb_get_size(cdb), w = 2ul * l;
+	const cdb_word_t first = cdb->file_start + (CDB_BUCKETS * w), last = cdb->hash_start;
+	if (cdb_bound_check(cdb, first > last) < 0)
+		return CDB_ERROR_E;
+	const cdb_word_t step = ((last - first) / ranges) ? ((last - first) / ranges) : 1ul;
+	boundaries[0] = first;
+	for (size_t i = 1; i <= ranges; i++)
+		boundaries[i] = last;
+	cdb_word_t sampled = 0;
+	for (size_t i = 0; i < CDB_BUCKETS && sampled < (CDB_PARTITION_SAMPLE * ranges); i++) {
+		cdb_word_t position = 0, length = 0;
+		if (cdb->index) {
+			position = cdb->index[i].position;
+			length   = cdb->index[i].length;
+		} else if (cdb_seek_internal(cdb, cdb->file_start + (i * w)) < 0 || cdb_read_word_pair(cdb, &position, &length) < 0) {
+			return CDB_ERROR_E;
+		}
+		if (length && cdb_seek_internal(cdb, position) < 0)
+			return CDB_ERROR_E;
+		while (length) {
+			uint8_t b[CDB_READ_BUFFER_LENGTH]; /* NOT INITIALIZED */
+			const size_t slots = CDB_MIN(length, (cdb_word_t)(sizeof (b) / w));
+			if (cdb_read(cdb, b, slots * w) < 0)
+				return CDB_ERROR_E;
+			for (size_t j = 0; j < slots; j++) {
+				const cdb_word_t p = cdb_unpack(b + (j * w) + l, l);
+				if (p == 0) /* empty slot */
+					continue;
+				if (cdb_bound_check(cdb, p < first || p >= last) < 0)
+					return CDB_ERROR_E;
+				const cdb_word_t k = CDB_MIN((p - first) / step, (cdb_word_t)(ranges - 1ul));
+				if (k && p < boundaries[k])
+					boundaries[k] = p;
+				sampled++;
+			}
+			length -= slots;
+		}
+	}
+	for (size_t i = ranges - 1ul; i > 0; i--)
+		boundaries[i] = CDB_MIN(boundaries[i], boundaries[i + 1ul]);
+	return cdb_failure(cdb);
+}
+
+/* Chunks are carved out of large blocks instead of being allocated one at
+ * a time, which saves the overhead of many small allocations, and they are
+ * never resized so there is no slack left over from growing arrays. The
+ * blocks grow with the number of entries so small databases stay small. */
+static void *cdb_block_allocate(cdb_t *cdb, size_t length) {
+	cdb_assert(cdb);
+	const size_t align = sizeof (cdb_align_t);
+	length = ((length + align - 1ul) / align) * align;
+	cdb_block_t *b = cdb->blocks;
+	if (!b || (b->length - b->used) < length) {
+		size_t size = CDB_MIN(cdb->allocated, CDB_BLOCK_LENGTH);
+		if (cdb->ops.memory)
+			size = CDB_MIN(size, cdb->ops.memory / 4ul);
+		size = size < length ? length : size;
+		if (cdb_overflow_check(cdb, (size + sizeof (*b)) < size) < 0)
+			return NULL;
+		if (!(b = cdb_allocate(cdb, sizeof (*b) + size)))
+			return NULL;
+		b->next   = cdb->blocks;
+		b->length = size;
+		b->used   = 0;
+		cdb->blocks = b;
+		cdb->allocated += sizeof (*b) + size;
+	}
+	void *r = ((uint8_t *)b->memory) + b->used;
+	b->used += length;
+	return r;
 }
 
 static int cdb_hash_grow(cdb_t *cdb, const cdb_word_t hash, const cdb_word_t position) {
 	cdb_assert(cdb);
 	cdb_hash_table_t *t1 = &cdb->table1[hash % CDB_BUCKETS];
-	cdb_word_t *hashes = t1->hashes, *fps = t1->fps;
-	const cdb_word_t next = cdb_round_up_to_next_power_of_two(t1->header.length + 1ul);
-	const cdb_word_t cur  = cdb_round_up_to_next_power_of_two(t1->header.length);
+	const size_t l = cdb_get_size(cdb);
 	if (cdb_overflow_check(cdb, (t1->header.length + 1ul) < t1->header.length) < 0)
 		return CDB_ERROR_E;
-	if (next > cur || t1->header.length == 0) {
-		const cdb_word_t alloc = t1->header.length == 0 ? 1ul : t1->header.length * 2ul;
-		if (cdb_overflow_check(cdb, (t1->header.length * 2ul) < t1->header.length) < 0)
+	cdb_chunk_t *c = t1->tail;
+	if (!c || c->length == c->capacity) { /* each chunk is as big as all the others together, up to a limit */
+		const cdb_word_t capacity = CDB_MIN(t1->header.length ? t1->header.length : 1ul, (cdb_word_t)CDB_CHUNK_LENGTH);
+		if (!(c = cdb_block_allocate(cdb, sizeof (*c) + (capacity * 2ul * l))))
 			return CDB_ERROR_E;
-		if (!(hashes = cdb_reallocate(cdb, t1->hashes, alloc * sizeof (*t1->hashes))))
+		c->next     = NULL;
+		c->length   = 0;
+		c->capacity = capacity;
+		if (t1->tail)
+			t1->tail->next = c;
+		else
+			t1->head = c;
+		t1->tail = c;
+	}
+	uint8_t *e = ((uint8_t *)c->entries) + (c->length * 2ul * l);
+	cdb_pack(e,     hash,     l);
+	cdb_pack(e + l, position, l);
+	c->length++;
+	t1->header.length++;
+	return cdb_failure(cdb);
+}
+
+/* When creating under a memory limit the hash table entries held in memory
+ * are written out as a "run" to a temporary resource, each run is ordered
+ * by bucket and the number of entries for each bucket in each run is kept
+ * so the runs can be merged back in the order the entries were added. */
+static int cdb_spill(cdb_t *cdb) {
+	cdb_assert(cdb);
+	const size_t l = cdb_get_size(cdb), w = 2ul * l;
+	if (!(cdb->spill)) {
+		char *name = cdb_name_extend(cdb, cdb->name, ".spill");
+		if (!name)
 			return CDB_ERROR_E;
-		t1->hashes = hashes;
-		if (!(fps = cdb_reallocate(cdb, t1->fps, alloc * sizeof (*t1->fps)))) {
-			(void)cdb_hash_free(cdb, t1);
+		cdb->spill = cdb->ops.open(name, CDB_TMP_MODE);
+		if (cdb_free(cdb, name) < 0 || !(cdb->spill))
+			return cdb_error(cdb, CDB_ERROR_OPEN_E);
+	}
+	cdb_word_t *runs = cdb_reallocate(cdb, cdb->runs, (cdb->nruns + 1ul) * CDB_BUCKETS * sizeof (*runs));
+	if (!runs)
+		return CDB_ERROR_E;
+	cdb->runs = runs;
+	runs += cdb->nruns * CDB_BUCKETS;
+	for (size_t i = 0; i < CDB_BUCKETS; i++) { /* the entries are already packed in the spill format */
+		cdb_hash_table_t *t = &cdb->table1[i];
+		runs[i] = t->header.length;
+		for (const cdb_chunk_t *c = t->head; c; c = c->next)
+			if (cdb->ops.write(cdb->spill, (void *)c->entries, c->length * w) != (c->length * w))
+				return cdb_error(cdb, CDB_ERROR_WRITE_E);
+		if (cdb_overflow_check(cdb, (t->spilled + t->header.length) < t->spilled) < 0)
 			return CDB_ERROR_E;
-		}
+		t->spilled += t->header.length;
+		t->header.length = 0;
 	}
-	t1->hashes = hashes;
-	t1->fps    = fps;
-	t1->hashes[t1->header.length] = hash;
-	t1->fps[t1->header.length]    = position;
-	t1->header.length++;
+	cdb->nruns++;
+	return cdb_hash_free(cdb) < 0 ? cdb_error(cdb, CDB_ERROR_E) : cdb_failure(cdb);
+}
+
+static int cdb_add_hashed(cdb_t *cdb, const cdb_buffer_t *key, const cdb_buffer_t *value, const cdb_word_t h) {
+	cdb_preconditions(cdb);
+	cdb_assert(key);
+	cdb_assert(value);
+	cdb_assert(cdb->position >= cdb->file_start);
+	if (cdb_overflow_check(cdb, (key->length + value->length) < key->length) < 0)
+		return CDB_ERROR_E;
+	const cdb_word_t record = (2ul * cdb_get_size(cdb)) + key->length + value->length, end = cdb->position + record;
+	if (cdb_overflow_check(cdb, record < (key->length + value->length) || end < cdb->position || end > cdb_get_mask(cdb)) < 0)
+		return CDB_ERROR_E; /* positions must fit in a word of the database */
+	if (cdb_hash_grow(cdb, h, cdb->position) < 0)
+		return CDB_ERROR_E;
+	if (cdb->ops.memory && cdb->allocated >= cdb->ops.memory)
+		if (cdb_spill(cdb) < 0)
+			return CDB_ERROR_E;
+	/* NB. No need to seek as we are the only thing that can affect
+	 * cdb->position in write mode */
+	if (cdb_write_word_pair(cdb, key->length, value->length) < 0)
+		return CDB_ERROR_E;
+	if (cdb_write(cdb, key->buffer, key->length) != key->length)
+		return CDB_ERROR_E;
+	if (cdb_write(cdb, value->buffer, value->length) != value->length)
+		return CDB_ERROR_E;
+	cdb->empty = 0;
 	return cdb_failure(cdb);
 }
 
@@ -783,7 +2536,6 @@ int cdb_add(cdb_t *cdb, const cdb_buffer_t *key, const cdb_buffer_t *value) {
 	cdb_assert(cdb->ops.hash);
 	cdb_assert(key);
 	cdb_assert(value);
-	cdb_assert(cdb->position >= cdb->file_start);
 	if (CDB_WRITE_ON == 0)
 		return cdb_error(cdb, CDB_ERROR_DISABLED_E);
 	if (cdb->error)
@@ -792,22 +2544,67 @@ int cdb_add(cdb_t *cdb, const cdb_buffer_t *key, const cdb_buffer_t *value) {
 		(void)cdb_error(cdb, CDB_ERROR_MODE_E);
 		goto fail;
 	}
-	if (cdb_overflow_check(cdb, (key->length + value->length) < key->length) < 0)
-		goto fail;
 	const cdb_word_t h = cdb->ops.hash((uint8_t*)(key->buffer), key->length) & cdb_get_mask(cdb);
-		if (cdb_hash_grow(cdb, h, cdb->position) < 0)
+	if (cdb_add_hashed(cdb, key, value, h) < 0)
+		goto fail;
+	return cdb_failure(cdb);
+fail:
+	return cdb_error(cdb, CDB_ERROR_E);
+}
+
+#define CDB_HASH_JOB_LENGTH (4096ul) /* number of keys hashed per job in "cdb_add_batch" */
+
+typedef struct {
+	const cdb_buffer_t *keys;
+	cdb_word_t *hashes;
+	size_t count;
+	cdb_word_t (*hash)(const uint8_t *data, size_t length);
+	cdb_word_t mask;
+} cdb_add_batch_t; /* used to hash keys in parallel */
+
+static int cdb_add_batch_job(void *param, size_t index) {
+	cdb_add_batch_t *b = param;
+	cdb_assert(b);
+	const size_t start = index * CDB_HASH_JOB_LENGTH, end = CDB_MIN(start + CDB_HASH_JOB_LENGTH, b->count);
+	for (size_t i = start; i < end; i++)
+		b->hashes[i] = b->hash((uint8_t *)(b->keys[i].buffer), b->keys[i].length) & b->mask;
+	return 0;
+}
+
+/* The keys are hashed first, which can be done on many threads, then the
+ * records are added in order so the database is exactly the same as if
+ * "cdb_add" had been called on each record in turn. */
+int cdb_add_batch(cdb_t *cdb, const cdb_buffer_t *keys, const cdb_buffer_t *values, const size_t count) {
+	cdb_preconditions(cdb);
+	cdb_assert(cdb->opened);
+	cdb_assert(cdb->ops.hash);
+	cdb_implies(count, keys);
+	cdb_implies(count, values);
+	cdb_word_t *hashes = NULL;
+	if (CDB_WRITE_ON == 0)
+		return cdb_error(cdb, CDB_ERROR_DISABLED_E);
+	if (cdb->error)
 		goto fail;
-	if (cdb_seek_internal(cdb, cdb->position) < 0)
+	if (cdb->create == 0) {
+		(void)cdb_error(cdb, CDB_ERROR_MODE_E);
 		goto fail;
-	if (cdb_write_word_pair(cdb, key->length, value->length) < 0)
+	}
+	if (count == 0)
+		return CDB_OK_E;
+	if (cdb_overflow_check(cdb, (count * sizeof *hashes) / sizeof *hashes != count) < 0)
 		goto fail;
-	if (cdb_write(cdb, key->buffer, key->length) != key->length)
+	if (!(hashes = cdb_allocate(cdb, count * sizeof *hashes)))
 		goto fail;
-	if (cdb_write(cdb, value->buffer, value->length) != value->length)
+	cdb_add_batch_t b = { .keys = keys, .hashes = hashes, .count = count, .hash = cdb->ops.hash, .mask = cdb_get_mask(cdb), };
+	if (cdb_parallel(cdb, cdb_add_batch_job, &b, (count + CDB_HASH_JOB_LENGTH - 1ul) / CDB_HASH_JOB_LENGTH) < 0)
 		goto fail;
-	cdb->empty = 0;
+	for (size_t i = 0; i < count; i++)
+		if (cdb_add_hashed(cdb, &keys[i], &values[i], hashes[i]) < 0)
+			goto fail;
+	(void)cdb_free(cdb, hashes);
 	return cdb_failure(cdb);
 fail:
+	(void)cdb_free(cdb, hashes);
 	return cdb_error(cdb, CDB_ERROR_E);
 }
 
@@ -828,6 +2625,65 @@ uint64_t cdb_prng(uint64_t s[2]) { /* XORSHIFT128: A few rounds of SPECK or TEA
 
 #define CDB_TEST_VECTOR_LEN (1024ul)
 
+typedef struct {
+	uint64_t count; /* number of records seen */
+	int bad;        /* set if a pointer and a read disagree */
+} cdb_test_foreach_t;
+
+static int cdb_test_compare_pointer(cdb_t *cdb, const cdb_file_pos_t *fp, cdb_test_foreach_t *f) {
+	cdb_assert(cdb);
+	cdb_assert(fp);
+	cdb_assert(f);
+	const void *p = NULL;
+	const int m = cdb_pointer(cdb, fp, &p);
+	if (m <= 0)
+		return m;
+	if (cdb_seek(cdb, fp->position) < 0) /* moves the file position from under "cdb_foreach" */
+		return -1;
+	for (cdb_word_t i = 0; i < fp->length; i += CDB_READ_BUFFER_LENGTH) {
+		uint8_t b[CDB_READ_BUFFER_LENGTH]; /* NOT INITIALIZED */
+		const cdb_word_t l = CDB_MIN((cdb_word_t)sizeof (b), fp->length - i);
+		if (cdb_read(cdb, b, l) < 0)
+			return -1;
+		if (memcmp(b, (const uint8_t *)p + i, l))
+			f->bad = 1;
+	}
+	return 0;
+}
+
+static int cdb_test_foreach(cdb_t *cdb, const cdb_file_pos_t *key, const cdb_file_pos_t *value, void *param) {
+	cdb_test_foreach_t *f = param;
+	cdb_assert(f);
+	f->count++;
+	if (cdb_test_compare_pointer(cdb, key, f) < 0 || cdb_test_compare_pointer(cdb, value, f) < 0)
+		return -1;
+	return 0;
+}
+
+typedef struct {
+	uint64_t offset, length;
+	unsigned calls;
+} cdb_test_advice_t;
+
+static cdb_test_advice_t cdb_test_advice[2]; /* the last region "cdb_test_advise" was given, by advice */
+
+static int cdb_test_advise(void *file, uint64_t offset, uint64_t length, int advice) {
+	cdb_assert(file);
+	cdb_assert(advice == CDB_ADVISE_WILLNEED || advice == CDB_ADVISE_RANDOM);
+	cdb_test_advice_t *a = &cdb_test_advice[advice];
+	a->offset = offset;
+	a->length = length;
+	a->calls++;
+	return 0;
+}
+
+static int cdb_test_resident(void *file, uint64_t offset, uint64_t length, uint64_t *bytes) {
+	cdb_assert(file);
+	cdb_assert(bytes);
+	*bytes = offset == cdb_test_advice[CDB_ADVISE_WILLNEED].offset ? length : 0;
+	return 0;
+}
+
 /* A series of optional unit tests that can be compiled out
  * of the program, the function will still remain even if the
  * contents of it are elided. */
@@ -880,9 +2736,50 @@ int cdb_tests(const cdb_options_t *ops, const char *test_file) {
 
 	cdb_t *cdb = NULL;
 	test_t *ts = NULL;
+	cdb_t *clone = NULL;
+	cdb_buffer_t *bk = NULL;
+	cdb_file_pos_t *bv = NULL;
 	uint64_t s[2] = { 0, };
 	int r = CDB_OK_E;
 
+	for (size_t i = 0; i < 40; i++) { /* key comparison, with a mismatch in every position */
+		uint8_t ka[40] = { 0, }, kb[40] = { 0, };
+		if (!cdb_key_equal(ka, kb, i))
+			r = -13;
+		for (size_t j = 0; j < i; j++) {
+			kb[j] = 1;
+			if (cdb_key_equal(ka, kb, i))
+				r = -13;
+			kb[j] = 0;
+		}
+	}
+
+	static const struct { unsigned id; const char *data; uint64_t hash; } hashes[] = { /* known answers */
+		{ CDB_HASH_DJB,       "abc", 0x0B873285ull, },
+		{ CDB_HASH_XXH64,     "",    0xEF46DB3751D8E999ull, },
+		{ CDB_HASH_XXH64,     "abc", 0x44BC2CF5AD770999ull, },
+		{ CDB_HASH_XXH64,     "01234567890123456789012345678901234567890123456789", 0x4F7CA65914623935ull, },
+		{ CDB_HASH_MURMUR64A, "abc", 0x9CC9C33498A95EFBull, },
+	};
+	for (size_t i = 0; i < 256; i++) { /* unrolled hashes against the reference, with random data and lengths */
+		uint8_t data[96] = { 0, };
+		const size_t length = i < 32 ? i : cdb_prng(s) % sizeof data;
+		for (size_t j = 0; j < length; j++)
+			data[j] = cdb_prng(s);
+		if (cdb_djb_hash(data, length) != cdb_djb_hash_reference(data, length))
+			r = -15;
+		if (cdb_djb64_hash(data, length) != (cdb_word_t)cdb_djb64_hash_reference(data, length))
+			r = -15;
+	}
+
+	for (size_t i = 0; i < (sizeof (hashes) / sizeof (hashes[0])); i++) {
+		const cdb_hash_info_t *h = cdb_hash_info(hashes[i].id);
+		if (!h || h != cdb_hash_find(h->name))
+			return CDB_ERROR_E;
+		if (h->hash((const uint8_t *)hashes[i].data, strlen(hashes[i].data)) != (cdb_word_t)hashes[i].hash)
+			r = -14;
+	}
+
 	if (cdb_open(&cdb, ops, 1, test_file) < 0)
 		return CDB_ERROR_E;
 
@@ -909,6 +2806,7 @@ int cdb_tests(const cdb_options_t *ops, const char *test_file) {
 		ts[i].vlen = vl;
 	}
 
+	cdb_buffer_t dkeys[sizeof (dups) / sizeof (dups[0])], dvalues[sizeof (dups) / sizeof (dups[0])];
 	for (size_t i = 0; i < dupcnt; i++) {
 		test_duplicate_t d = dups[i];
 		const cdb_buffer_t key   = { .length = strlen(d.key),   .buffer = d.key };
@@ -921,9 +2819,11 @@ int cdb_tests(const cdb_options_t *ops, const char *test_file) {
 			if (memcmp(ts[i].value, ts[j].value, vlen) == 0)
 				ts[i].recno++;
 
-		if (cdb_add(cdb, &key, &value) < 0)
-			goto fail;
+		dkeys[i]   = key;
+		dvalues[i] = value;
 	}
+	if (cdb_add_batch(cdb, dkeys, dvalues, dupcnt) < 0) /* same as calling "cdb_add" on each */
+		goto fail;
 
 
 	if (cdb_close(cdb) < 0) {
@@ -937,6 +2837,10 @@ int cdb_tests(const cdb_options_t *ops, const char *test_file) {
 		return -1;
 	}
 
+	const int cl = cdb_clone(&clone, cdb); /* clones need "read_at" or "map" */
+	if (cl < 0 && cl != CDB_ERROR_DISABLED_E)
+		goto fail;
+
 	for (unsigned i = 0; i < (vectors + dupcnt); i++) {
 		test_t *t = &ts[i];
 		const cdb_buffer_t key = { .length = t->klen, .buffer = t->key };
@@ -966,22 +2870,228 @@ int cdb_tests(const cdb_options_t *ops, const char *test_file) {
 				goto fail;
 			if (memcmp(t->result, t->value, result.length))
 				r = -6;
+			const void *p = NULL;
+			const int m = cdb_pointer(cdb, &result, &p);
+			if (m < 0)
+				goto fail;
+			if (m > 0 && memcmp(p, t->value, result.length))
+				r = -8;
 		}
 
+		if (cdb_may_contain(cdb, &key) != 1)
+			r = -20;
+
 		uint64_t cnt = 0;
 		if (cdb_count(cdb, &key, &cnt) < 0)
 			goto fail;
 		if (cnt < t->recno)
 			r = -7;
+
+		if (clone) {
+			cdb_file_pos_t cloned = { 0, 0 };
+			if (cdb_lookup(clone, &key, &cloned, t->recno) < 0)
+				goto fail;
+			if (cloned.position != result.position || cloned.length != result.length)
+				r = -9;
+			if (cdb_seek(clone, cloned.position) < 0)
+				goto fail;
+			if (cdb_read(clone, t->result, cloned.length) < 0)
+				goto fail;
+			if (memcmp(t->result, t->value, cloned.length))
+				r = -10;
+		}
+	}
+
+	uint64_t hits = 0, misses = 0; /* keys are looked up more than once above */
+	if (cdb_cache_counts(cdb, &hits, &misses) < 0)
+		goto fail;
+	if (ops->cache && (hits == 0 || misses == 0))
+		r = -19;
+
+	cdb_stats_t stats; /* and the rest, if they are kept */
+	const int kept = cdb_stats_get(cdb, &stats);
+	if (kept < 0)
+		goto fail;
+	if (stats.hits != hits || stats.misses != misses)
+		r = -22;
+	if (kept) {
+		uint64_t probed = 0, timed = 0;
+		for (size_t i = 0; i < CDB_STATS_BUCKETS; i++) {
+			probed += stats.probe_histogram[i];
+			timed  += stats.latency_histogram[i];
+		}
+		if (stats.lookups < vectors || stats.found == 0 || stats.found > stats.lookups)
+			r = -22;
+		if (probed != stats.lookups || (ops->ticks && timed != stats.lookups))
+			r = -22;
+		if (stats.probes == 0 || stats.probes_max == 0)
+			r = -22;
+		if (!cdb->memory && (stats.reads == 0 || stats.bytes == 0))
+			r = -22;
+	}
+
+	cdb_async_t as[7]; /* asynchronous lookups, a few at a time with their reads done in turn */
+	cdb_buffer_t ak[7];
+	size_t ai[7] = { 0, }, next = 0, done = 0;
+	int ag[7] = { 0, };
+	for (size_t j = 0; done < (vectors + dupcnt); j = (j + 1ul) % 7ul) {
+		if (ag[j] == CDB_ASYNC_READ) {
+			const cdb_word_t got = cdb_seek_internal(cdb, as[j].offset - cdb->ops.offset) < 0 ? 0 : cdb_read_internal(cdb, as[j].buffer, as[j].length);
+			if ((ag[j] = cdb_async_step(cdb, &as[j], got)) < 0)
+				goto fail;
+			continue;
+		}
+		if (ai[j]) { /* done, check it against a normal lookup */
+			test_t *t = &ts[ai[j] - 1ul];
+			const cdb_buffer_t key = { .length = t->klen, .buffer = t->key, };
+			cdb_file_pos_t expect = { 0, 0, };
+			if (cdb_lookup(cdb, &key, &expect, t->recno) < 0)
+				goto fail;
+			if (ag[j] != CDB_FOUND_E || as[j].value.position != expect.position || as[j].value.length != expect.length)
+				r = -21;
+			ai[j] = 0;
+			done++;
+		}
+		if (next < (vectors + dupcnt)) {
+			test_t *t = &ts[next];
+			ai[j] = ++next;
+			ak[j] = (cdb_buffer_t) { .length = t->klen, .buffer = t->key, };
+			if ((ag[j] = cdb_async_start(cdb, &as[j], &ak[j], t->recno)) < 0)
+				goto fail;
+		}
+	}
+
+	size_t maybe = 0; /* keys that are not in the database, as '#' is never used */
+	for (size_t i = 0; i < vectors; i++) {
+		char k[CDB_TEST_VECTOR_LEN] = { '#', };
+		const cdb_buffer_t key = { .length = (cdb_prng(s) % (klen - 1ul)) + 1ul, .buffer = k, };
+		for (size_t j = 1; j < key.length; j++)
+			k[j] = 'a' + (cdb_prng(s) % 26);
+		const int m = cdb_may_contain(cdb, &key);
+		if (m < 0)
+			goto fail;
+		maybe += m;
+		cdb_file_pos_t missing = { 0, 0, };
+		if (cdb_get(cdb, &key, &missing) != CDB_NOT_FOUND_E)
+			r = -20;
+		cdb_async_t a; /* one at a time this time */
+		int g = cdb_async_start(cdb, &a, &key, 0);
+		while (g == CDB_ASYNC_READ)
+			g = cdb_async_step(cdb, &a, cdb_seek_internal(cdb, a.offset - cdb->ops.offset) < 0 ? 0 : cdb_read_internal(cdb, a.buffer, a.length));
+		if (g != CDB_NOT_FOUND_E || a.value.position)
+			r = -21;
 	}
+	if (ops->filter >= 8 && maybe > (vectors / 8ul))
+		r = -20;
 
+	const size_t n = vectors + dupcnt;
+	if (!(bk = cdb_allocate(cdb, n * sizeof *bk)) || !(bv = cdb_allocate(cdb, n * sizeof *bv)))
+		goto fail;
+	for (size_t i = 0; i < n; i++)
+		bk[i] = (cdb_buffer_t) { .length = ts[i].klen, .buffer = ts[i].key };
+	cdb_stats_t before, after; /* each key of a batch counts as a lookup */
+	if (cdb_stats_get(cdb, &before) < 0)
+		goto fail;
+	const int found = cdb_lookup_batch(cdb, bk, bv, n);
+	if (found < 0)
+		goto fail;
+	if ((size_t)found != n)
+		r = -11;
+	if (cdb_stats_get(cdb, &after) < 0)
+		goto fail;
+	if (kept && ((after.lookups - before.lookups) != n || (after.found - before.found) != n))
+		r = -22;
+	for (size_t i = 0; i < n; i++) {
+		cdb_file_pos_t single = { 0, 0 };
+		if (cdb_get(cdb, &bk[i], &single) < 0)
+			goto fail;
+		if (single.position != bv[i].position || single.length != bv[i].length)
+			r = -12;
+	}
+
+	cdb_test_foreach_t f = { .count = 0, .bad = 0, };
+	if (cdb_foreach(cdb, cdb_test_foreach, &f) < 0)
+		goto fail;
+	if (f.count != n || f.bad)
+		r = -16;
+
+	cdb_test_foreach_t itf = { .count = 0, .bad = 0, };
+	cdb_iter_t it = { 0, 0, };
+	if (cdb_iter_init(cdb, &it) < 0)
+		goto fail;
+	for (int more = 1; more;) { /* stop half way and carry on with a new iterator */
+		cdb_file_pos_t key = { 0, 0, }, value = { 0, 0, };
+		if ((more = cdb_iter_next(cdb, &it, &key, &value)) < 0)
+			goto fail;
+		if (more && cdb_test_foreach(cdb, &key, &value, &itf) < 0)
+			goto fail;
+		if (more && itf.count == (n / 2ul)) {
+			const cdb_word_t saved = it.position;
+			if (cdb_iter_init(cdb, &it) < 0 || cdb_iter_seek(cdb, &it, saved) < 0)
+				goto fail;
+		}
+	}
+	if (itf.count != n || itf.bad)
+		r = -18;
+
+	static const size_t partitions[] = { 1, 7, 3000, };
+	for (size_t i = 0; i < (sizeof (partitions) / sizeof (partitions[0])); i++) {
+		const size_t ranges = partitions[i];
+		cdb_word_t *boundaries = cdb_allocate(cdb, (ranges + 1ul) * sizeof (*boundaries));
+		cdb_test_foreach_t pf = { .count = 0, .bad = 0, };
+		if (!boundaries || cdb_partition(cdb, boundaries, ranges) < 0) {
+			(void)cdb_free(cdb, boundaries);
+			goto fail;
+		}
+		for (size_t j = 0; j < ranges; j++) {
+			if (boundaries[j] > boundaries[j + 1ul])
+				r = -17;
+			else if (cdb_foreach_range(clone ? clone : cdb, boundaries[j], boundaries[j + 1ul], cdb_test_foreach, &pf) < 0)
+				break;
+		}
+		if (cdb_free(cdb, boundaries) < 0 || cdb_status(cdb) < 0 || (clone && cdb_status(clone) < 0))
+			goto fail;
+		if (pf.count != n || pf.bad)
+			r = -17;
+	}
+
+	cdb_options_t wo = *ops; /* warm the hash tables, and only them */
+	wo.flags    = (wo.flags & ~CDB_OPTION_WARM_ALL) | CDB_OPTION_WARM | CDB_OPTION_RANDOM;
+	wo.advise   = cdb_test_advise;
+	wo.resident = cdb_test_resident;
+	memset(cdb_test_advice, 0, sizeof (cdb_test_advice));
+	cdb_t *warmed = NULL;
+	if (cdb_open(&warmed, &wo, 0, test_file) < 0)
+		goto fail;
+	const cdb_test_advice_t *need = &cdb_test_advice[CDB_ADVISE_WILLNEED], *rnd = &cdb_test_advice[CDB_ADVISE_RANDOM];
+	const uint64_t records = CDB_BUCKETS * (2ul * cdb_get_size(warmed)), tables = warmed->file_end - warmed->hash_start;
+	uint64_t resident = 0, length = 0;
+	if (cdb_warm_progress(warmed, &resident, &length) != 1)
+		r = -23;
+	if (warmed->tables ? need->calls != 0 || length != 0 :
+			need->calls != 1 || need->offset != (ops->offset + warmed->hash_start) || need->length != tables || length != tables || resident != tables)
+		r = -23;
+	if (rnd->calls != 1 || rnd->offset != (ops->offset + records) || rnd->length != (warmed->hash_start - records))
+		r = -23;
+	if (cdb_close(warmed) < 0)
+		goto fail;
+
+	if (cdb_free(cdb, bk) < 0)
+		r = -1;
+	if (cdb_free(cdb, bv) < 0)
+		r = -1;
 	if (cdb_free(cdb, ts) < 0)
 		r = -1;
+	if (cdb_close(clone) < 0)
+		r = -1;
 	if (cdb_close(cdb) < 0)
 		r = -1;
 	return r;
 fail:
 	(void)ops->allocator(ops->arena, ts, 0, 0);
+	(void)ops->allocator(ops->arena, bk, 0, 0);
+	(void)ops->allocator(ops->arena, bv, 0, 0);
+	(void)cdb_close(clone);
 	(void)cdb_close(cdb);
 	return CDB_ERROR_E;
 }
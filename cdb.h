@@ -26,7 +26,32 @@ typedef uint64_t cdb_word_t; /* valid sizes: uint64_t, uint32_t, uint16_t */
 struct cdb;
 typedef struct cdb cdb_t;
 
-enum { CDB_RO_MODE, CDB_RW_MODE, }; /* passed to "open" in the "mode" option */
+enum { CDB_RO_MODE, CDB_RW_MODE, CDB_TMP_MODE, }; /* passed to "open" in the "mode" option */
+
+enum { /* bits for the "flags" option */
+	CDB_OPTION_INDEX    = 1u << 0, /* keep the initial hash table in memory when reading */
+	CDB_OPTION_TABLES   = 1u << 1, /* keep the secondary hash tables in memory as well when reading (implies CDB_OPTION_INDEX) */
+	CDB_OPTION_WARM     = 1u << 2, /* have the secondary hash tables read in to memory in the background when opened for reading, with "advise" */
+	CDB_OPTION_WARM_ALL = 1u << 3, /* as above, but the whole database */
+	CDB_OPTION_RANDOM   = 1u << 4, /* the records will be looked up and not read in order, "advise" is told so that reads are not read ahead */
+};
+
+enum { CDB_ADVISE_WILLNEED, CDB_ADVISE_RANDOM, }; /* passed to "advise" in the "advice" argument */
+
+enum { /* hash identifiers, these will not change so they can be stored alongside a database */
+	CDB_HASH_DJB,       /* default hash, as used by the original CDB program */
+	CDB_HASH_DJB64,     /* default for 64-bit databases, a 64-bit version of the above */
+	CDB_HASH_SDBM64,    /* SDBM hash, used for 64-bit databases if the library was built with CDB_USE_SDBM64 */
+	CDB_HASH_XXH64,     /* XXH64 (seed zero), fast for long keys, not compatible with other CDB implementations */
+	CDB_HASH_MURMUR64A, /* MurmurHash64A (seed zero), not compatible with other CDB implementations */
+};
+
+typedef struct {
+	const char *name; /* name used to select hash at run time, e.g. "xxh64" */
+	cdb_word_t (*hash)(const uint8_t *data, size_t length); /* suitable for the "hash" option */
+	unsigned id;      /* CDB_HASH_* value */
+	unsigned bits;    /* number of bits the hash produces, truncated if bigger than "cdb_word_t" */
+} cdb_hash_info_t;
 
 typedef struct {
 	void *(*allocator)(void *arena, void *ptr, size_t oldsz, size_t newsz);
@@ -35,13 +60,26 @@ typedef struct {
 	cdb_word_t (*read)(void *file, void *buf, size_t length); /* always needed, read from a resource */
 	cdb_word_t (*write)(void *file, void *buf, size_t length); /* (conditionally optional) needed for db creation only, write to a resource */
 	int (*seek)(void *file, uint64_t offset); /* "tell" is not needed as we keep track of the file position internally */
-	void *(*open)(const char *name, int mode); /* open up a resource, which may or may not be a file, for reading (mode = CDB_RO_MODE) or read/write (mode = CDB_RW_MODE) */
+	void *(*open)(const char *name, int mode); /* open up a resource, which may or may not be a file, for reading (mode = CDB_RO_MODE) or read/write (mode = CDB_RW_MODE), or a temporary resource for read/write that is removed when closed (mode = CDB_TMP_MODE, only used with the "memory" option, "name" is a hint) */
 	int (*close)(void *file); /* close a resource opened up with "open" */
 	int (*flush)(void *file); /* (optional) called at end of successful creation */
 
 	void *arena;       /* used for 'arena' argument for the allocator, can be NULL if allocator allows it */
 	cdb_word_t offset; /* starting offset for CDB file if not at beginning of file */
 	unsigned size;     /* Either 0 (defaults 32), 16, 32 or 64, but cannot be bigger than 'sizeof(cdb_word_t)*8' in any case */
+
+	const void *(*map)(void *file, uint64_t *length); /* (optional) return pointer to entire resource in memory (and its length), NULL if not possible, read mode only */
+	cdb_word_t (*read_at)(void *file, void *buf, size_t length, uint64_t offset); /* (optional) read from an offset without using or changing the file position, needed by "cdb_clone" if not mapped */
+	unsigned flags;    /* (optional) CDB_OPTION_* bits, zero for defaults */
+	size_t buffer;     /* (optional) size in bytes of buffer used to gather up writes when creating a database, zero for no buffering */
+	int (*parallel)(int (*job)(void *param, size_t index), void *param, size_t count, unsigned threads); /* (optional) call "job" for each "index" below "count", using up to "threads" threads, negative if any job failed */
+	unsigned threads;  /* (optional) number of threads "parallel" may use, 0 or 1 means do everything on the calling thread */
+	size_t memory;     /* (optional) rough limit in bytes on the memory used to hold hash table entries when creating, they are spilled to a temporary resource when it is reached, zero for no limit */
+	size_t cache;      /* (optional) number of entries in a cache of keys found, shared by a read handle and its clones, zero for none */
+	unsigned filter;   /* (optional) bits per key of a Bloom filter written next to the database when creating, zero for none, when reading any non-zero value uses the filter if there is one */
+	uint64_t (*ticks)(void); /* (optional) a clock in any unit (nanoseconds, say), used to time lookups if the library was built with CDB_STATS_ON */
+	int (*advise)(void *file, uint64_t offset, uint64_t length, int advice); /* (optional) hint how part of a resource opened for reading will be used, CDB_ADVISE_*, failures are ignored */
+	int (*resident)(void *file, uint64_t offset, uint64_t length, uint64_t *bytes); /* (optional) set "bytes" to how much of part of a resource is in memory, negative if that is not known, for "cdb_warm_progress" */
 } cdb_options_t; /* a file abstraction layer, could point to memory, flash, or disk */
 
 typedef struct {
@@ -54,25 +92,83 @@ typedef struct {
 	cdb_word_t length;   /* length of data on disk, for use with cdb_read */
 } cdb_file_pos_t; /* used to represent a value on disk that can be accessed via 'cdb_options_t' */
 
+typedef struct {
+	cdb_word_t position; /* position of the next record, can be saved and passed to "cdb_iter_seek" to carry on later */
+	cdb_word_t end;      /* iteration stops at this position, all of the records by default */
+} cdb_iter_t; /* cursor for visiting each record in turn, see "cdb_iter_init" */
+
+#ifndef CDB_STATS_BUCKETS /* number of buckets in each histogram of "cdb_stats_t" */
+#define CDB_STATS_BUCKETS (32u)
+#endif
+
+typedef struct {
+	uint64_t seeks, reads;  /* calls to "seek" and to "read" or "read_at" (reads of a mapped database are not counted) ... */
+	uint64_t bytes;         /* ... and the bytes they read */
+	uint64_t lookups;       /* keys looked up, which includes "cdb_get", "cdb_lookup", "cdb_count" and "cdb_lookup_batch" */
+	uint64_t found;         /* ... of which were found */
+	uint64_t probes;        /* secondary hash table slots looked at by those lookups ... */
+	uint64_t probes_max;    /* ... and the most looked at by one of them */
+	uint64_t collisions;    /* records whose hash matched a key being looked up but whose key did not */
+	uint64_t hits, misses;  /* lookups found, or not, in the "cache", these are always counted */
+	uint64_t probe_histogram[CDB_STATS_BUCKETS];   /* lookups by slots looked at, bucket 0 is for none, bucket "i" for 2^(i-1) up to 2^i - 1 */
+	uint64_t latency_histogram[CDB_STATS_BUCKETS]; /* lookups by time taken with the "ticks" option, bucketed as above */
+} cdb_stats_t; /* counters kept for each handle, see "cdb_stats_get" */
+
+#ifndef CDB_ASYNC_BUFFER_LENGTH /* bytes read at once by an asynchronous lookup, at least 2 * 2 * sizeof (cdb_word_t) */
+#define CDB_ASYNC_BUFFER_LENGTH (256u)
+#endif
+
+enum { CDB_ASYNC_READ = 2, }; /* returned by "cdb_async_start" and "cdb_async_step" when a read is wanted */
+
+typedef struct {
+	void *file;          /* read wanted: from this resource (as given to "read_at") ... */
+	uint64_t offset;     /* ... at this offset (the "offset" option has been added) ... */
+	size_t length;       /* ... this many bytes into 'buffer' */
+	cdb_file_pos_t value; /* value of the record found, when done */
+	/* the rest is private to the library */
+	const cdb_buffer_t *key;
+	uint64_t record, recno;
+	cdb_word_t hash, table, slots, start, visited, run, candidate, compared;
+	int state;
+	uint8_t buffer[CDB_ASYNC_BUFFER_LENGTH];
+} cdb_async_t; /* state of a lookup that does its reads through the caller, see "cdb_async_start" */
+
 typedef int (*cdb_callback)(cdb_t *cdb, const cdb_file_pos_t *key, const cdb_file_pos_t *value, void *param);
 
 /* All functions return: < 0 on failure, 0 on success/not found, 1 on found if applicable */
 CDB_API int cdb_open(cdb_t **cdb, const cdb_options_t *ops, int create, const char *file); /* arena may be NULL, allocator must be present */
 CDB_API int cdb_close(cdb_t *cdb);  /* free cdb, close handles (and write to disk if in create mode) */
+CDB_API int cdb_clone(cdb_t **clone, cdb_t *cdb); /* make a cheap handle for another thread that shares the database opened (for reading) by "cdb" */
 CDB_API int cdb_read(cdb_t *cdb, void *buf, cdb_word_t length); /* Returns error code not length! Not being able to read "length" bytes is an error! */
 CDB_API int cdb_add(cdb_t *cdb, const cdb_buffer_t *key, const cdb_buffer_t *value); /* do not call cdb_read and/or cdb_seek in open mode */
+CDB_API int cdb_add_batch(cdb_t *cdb, const cdb_buffer_t *keys, const cdb_buffer_t *values, size_t count); /* "cdb_add" for many records at once, keys are hashed in parallel if possible */
 CDB_API int cdb_seek(cdb_t *cdb, cdb_word_t position);
 CDB_API int cdb_foreach(cdb_t *cdb, cdb_callback cb, void *param);
+CDB_API int cdb_partition(cdb_t *cdb, cdb_word_t *boundaries, size_t ranges); /* split the records into "ranges" ranges, "boundaries" must have room for "ranges + 1" positions, range "i" is from "boundaries[i]" up to "boundaries[i + 1]" */
+CDB_API int cdb_foreach_range(cdb_t *cdb, cdb_word_t start, cdb_word_t end, cdb_callback cb, void *param); /* "cdb_foreach" for one range from "cdb_partition", ranges can be done at once on clones */
+CDB_API int cdb_iter_init(cdb_t *cdb, cdb_iter_t *it); /* start "it" at the first record */
+CDB_API int cdb_iter_next(cdb_t *cdb, cdb_iter_t *it, cdb_file_pos_t *key, cdb_file_pos_t *value); /* returns 1 and sets "key" and "value" for the next record, 0 when there are no more */
+CDB_API int cdb_iter_seek(cdb_t *cdb, cdb_iter_t *it, cdb_word_t position); /* carry on from "position", which must be the start of a record, such as a saved "it->position" */
 CDB_API int cdb_read_word_pair(cdb_t *cdb, cdb_word_t *w1, cdb_word_t *w2);
 CDB_API int cdb_get(cdb_t *cdb, const cdb_buffer_t *key, cdb_file_pos_t *value);
 CDB_API int cdb_lookup(cdb_t *cdb, const cdb_buffer_t *key, cdb_file_pos_t *value, uint64_t record);
+CDB_API int cdb_lookup_batch(cdb_t *cdb, const cdb_buffer_t *keys, cdb_file_pos_t *values, size_t count); /* "cdb_get" for many keys at once, returns number found */
+CDB_API int cdb_async_start(cdb_t *cdb, cdb_async_t *a, const cdb_buffer_t *key, uint64_t record); /* "cdb_lookup" as a state machine, returns CDB_ASYNC_READ when the read described in "a" is needed */
+CDB_API int cdb_async_step(cdb_t *cdb, cdb_async_t *a, size_t length); /* carry on after the read from "cdb_async_start" or "cdb_async_step" got "length" bytes */
+CDB_API int cdb_may_contain(cdb_t *cdb, const cdb_buffer_t *key); /* returns 0 if "key" is definitely not in the database, 1 if it might be */
 CDB_API int cdb_count(cdb_t *cdb, const cdb_buffer_t *key, uint64_t *count);
+CDB_API int cdb_pointer(cdb_t *cdb, const cdb_file_pos_t *fp, const void **pointer); /* returns 1 and sets "pointer" if the data is in memory, either mapped or in the read ahead buffer filled by "cdb_iter_next" (valid only until the next read or iterator step on this handle), 0 (and NULL) if not */
 CDB_API int cdb_status(cdb_t *cdb); /* returns CDB error status */
+CDB_API int cdb_cache_counts(cdb_t *cdb, uint64_t *hits, uint64_t *misses); /* lookups on this handle that were found, or not, in the "cache" */
+CDB_API int cdb_stats_get(cdb_t *cdb, cdb_stats_t *stats); /* copy out the counters of this handle, returns 1 if they are kept (CDB_STATS_ON), 0 if only the cache counts are */
+CDB_API int cdb_warm_progress(cdb_t *cdb, uint64_t *resident, uint64_t *length); /* bytes of what CDB_OPTION_WARM or CDB_OPTION_WARM_ALL asked for that are in memory, returns 1 if known, 0 if not */
 CDB_API int cdb_version(unsigned long *version); /* version number in x.y.z format, z = LSB, MSB is library info */
 CDB_API int cdb_tests(const cdb_options_t *ops, const char *test_file);
 
 CDB_API uint64_t cdb_prng(uint64_t s[2]); /* "s" is PRNG state, you can set it to any value you like to seed */
 CDB_API cdb_word_t cdb_hash(const uint8_t *data, size_t length); /* hash used by original CDB program */
+CDB_API const cdb_hash_info_t *cdb_hash_info(unsigned id); /* get built in hash by CDB_HASH_* identifier, NULL if there is no such hash */
+CDB_API const cdb_hash_info_t *cdb_hash_find(const char *name); /* get built in hash by name, NULL if there is no such hash */
 
 #ifdef __cplusplus
 }
@@ -1,14 +1,256 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* for "syscall" */
 #include "cdb.h"
 #include "host.h"
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #define UNUSED(X) ((void)(X))
 
+#ifndef CDB_HOST_RELOAD /* swap to a replaced database with "cdb_host_reload_check", the readers need atomics */
+#ifdef __GNUC__
+#define CDB_HOST_RELOAD (1)
+#else
+#define CDB_HOST_RELOAD (0)
+#endif
+#endif
+
+#ifndef CDB_HOST_SERVER /* serve lookups over the memcached protocol with "cdb_host_serve", needs epoll */
+#ifdef __linux__
+#define CDB_HOST_SERVER (1)
+#else
+#define CDB_HOST_SERVER (0)
+#endif
+#endif
+
+#ifndef CDB_HOST_IO_URING /* queue up the reads of asynchronous lookups with io_uring, if it is available */
+#ifdef __linux__
+#define CDB_HOST_IO_URING (1)
+#else
+#define CDB_HOST_IO_URING (0)
+#endif
+#endif
+
+#ifdef _WIN32 /* No memory mapping or positional reads on Windows (yet), "cdb_mmap_options" falls back to reading the file */
+static void *map_file(FILE *f, size_t *length) { UNUSED(f); *length = 0; return NULL; }
+static int unmap_file(void *m, size_t length) { UNUSED(m); UNUSED(length); return 0; }
+static size_t read_file_at(FILE *f, void *buf, size_t length, uint64_t offset) { UNUSED(f); UNUSED(buf); UNUSED(length); UNUSED(offset); return 0; }
+static uint64_t ticks(void) { return (uint64_t)clock() * (1000000000ull / CLOCKS_PER_SEC); }
+static void sleep_us(unsigned long us) { UNUSED(us); } /* there are no other threads to wait for */
+static int advise_file(FILE *f, void *map, size_t map_length, uint64_t offset, uint64_t length, int advice) { UNUSED(f); UNUSED(map); UNUSED(map_length); UNUSED(offset); UNUSED(length); UNUSED(advice); return 0; }
+static int resident_file(FILE *f, uint64_t offset, uint64_t length, uint64_t *bytes) { UNUSED(f); UNUSED(offset); UNUSED(length); *bytes = 0; return -1; }
+static int run_parallel(int (*job)(void *param, size_t index), void *param, size_t count, unsigned threads) {
+	UNUSED(threads);
+	for (size_t i = 0; i < count; i++)
+		if (job(param, i) < 0)
+			return -1;
+	return 0;
+}
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+static void *map_file(FILE *f, size_t *length) {
+	assert(f);
+	assert(length);
+	*length = 0;
+	struct stat s;
+	if (fstat(fileno(f), &s) < 0)
+		return NULL;
+	if (s.st_size <= 0 || (uintmax_t)s.st_size > SIZE_MAX)
+		return NULL;
+	void *m = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	if (m == MAP_FAILED)
+		return NULL;
+	*length = s.st_size;
+	return m;
+}
+
+static int unmap_file(void *m, size_t length) {
+	return munmap(m, length);
+}
+
+static uint64_t ticks(void) { /* nanoseconds */
+	struct timespec t;
+	if (clock_gettime(CLOCK_MONOTONIC, &t) < 0)
+		return 0;
+	return ((uint64_t)t.tv_sec * 1000000000ull) + (uint64_t)t.tv_nsec;
+}
+
+static void sleep_us(unsigned long us) {
+	const struct timespec t = { .tv_sec = us / 1000000ul, .tv_nsec = (us % 1000000ul) * 1000ul, };
+	(void)nanosleep(&t, NULL);
+}
+
+/* This bypasses the "FILE" buffer, which is what we want, it is not thread
+ * safe and positional reads are used when the handle is shared. */
+static size_t read_file_at(FILE *f, void *buf, size_t length, uint64_t offset) {
+	assert(f);
+	assert(buf);
+	size_t r = 0;
+	while (r < length) {
+		const ssize_t n = pread(fileno(f), (char*)buf + r, length - r, offset + r);
+		if (n <= 0)
+			break;
+		r += n;
+	}
+	return r;
+}
+
+#define PREFETCH_CHUNK (8ull * 1024ull * 1024ull) /* bytes asked to be read ahead at once */
+
+typedef struct {
+	int fd;
+	uint64_t offset, length;
+} prefetch_t;
+
+/* Asking for a lot to be read ahead can block until the reads have been
+ * queued up, so it is done on a thread of its own, with its own descriptor
+ * as the file may be closed before it is done. */
+static void *prefetch(void *arg) {
+	prefetch_t *p = arg;
+	assert(p);
+#ifdef POSIX_FADV_WILLNEED
+	for (uint64_t done = 0; done < p->length; done += PREFETCH_CHUNK) {
+		const uint64_t l = p->length - done < PREFETCH_CHUNK ? p->length - done : PREFETCH_CHUNK;
+		if (posix_fadvise(p->fd, p->offset + done, l, POSIX_FADV_WILLNEED))
+			break;
+	}
+#endif
+	(void)close(p->fd);
+	free(p);
+	return NULL;
+}
+
+static int advise_file(FILE *f, void *map, size_t map_length, uint64_t offset, uint64_t length, int advice) {
+	assert(f);
+	if (advice == CDB_ADVISE_RANDOM) { /* a mapping has its own read ahead, separate from that of the file */
+		if (map) {
+			const uint64_t page = sysconf(_SC_PAGESIZE), start = offset - (offset % page);
+			const uint64_t end = offset + length < map_length ? offset + length : map_length;
+			return start < end ? posix_madvise((char *)map + start, end - start, POSIX_MADV_RANDOM) : -1;
+		}
+#ifdef POSIX_FADV_RANDOM
+		return posix_fadvise(fileno(f), offset, length, POSIX_FADV_RANDOM) ? -1 : 0;
+#else
+		return 0;
+#endif
+	}
+	prefetch_t *p = malloc(sizeof (*p));
+	if (!p)
+		return -1;
+	*p = (prefetch_t) { .fd = dup(fileno(f)), .offset = offset, .length = length, };
+	if (p->fd < 0) {
+		free(p);
+		return -1;
+	}
+	pthread_attr_t attr;
+	pthread_t id;
+	int started = 0;
+	if (!pthread_attr_init(&attr)) {
+		started = !pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) && !pthread_create(&id, &attr, prefetch, p);
+		(void)pthread_attr_destroy(&attr);
+	}
+	if (!started)
+		(void)prefetch(p);
+	return 0;
+}
+
+#ifdef __linux__
+typedef unsigned char mincore_t;
+#else
+typedef char mincore_t;
+#endif
+
+/* Looks at what of the file is in the page cache through a mapping of its
+ * own, a window at a time */
+static int resident_file(FILE *f, uint64_t offset, uint64_t length, uint64_t *bytes) {
+	assert(f);
+	assert(bytes);
+	const uint64_t page = sysconf(_SC_PAGESIZE), end = offset + length;
+	mincore_t v[4096];
+	*bytes = 0;
+	for (uint64_t at = offset - (offset % page); at < end;) {
+		const size_t l = end - at < (sizeof (v) * page) ? end - at : (sizeof (v) * page);
+		void *m = mmap(NULL, l, PROT_READ, MAP_SHARED, fileno(f), at);
+		if (m == MAP_FAILED)
+			return -1;
+		const int e = mincore(m, l, v);
+		(void)munmap(m, l);
+		if (e < 0)
+			return -1;
+		for (size_t i = 0; i < (l + page - 1u) / page; i++)
+			*bytes += (v[i] & 1u) ? page : 0;
+		at += l;
+	}
+	return 0;
+}
+
+typedef struct {
+	int (*job)(void *param, size_t index);
+	void *param;
+	size_t count, next; /* jobs are handed out in order */
+	int error;
+	pthread_mutex_t lock;
+} parallel_t;
+
+static void *parallel_worker(void *arg) {
+	parallel_t *p = arg;
+	assert(p);
+	for (;;) {
+		if (pthread_mutex_lock(&p->lock))
+			return NULL;
+		const size_t i = p->error ? p->count : p->next;
+		p->next += i < p->count;
+		(void)pthread_mutex_unlock(&p->lock);
+		if (i >= p->count)
+			return NULL;
+		if (p->job(p->param, i) < 0) {
+			if (pthread_mutex_lock(&p->lock))
+				return NULL;
+			p->error = -1;
+			(void)pthread_mutex_unlock(&p->lock);
+		}
+	}
+}
+
+/* The calling thread does its share of the jobs, if threads cannot be
+ * created then fewer are used, all the jobs get done regardless. */
+static int run_parallel(int (*job)(void *param, size_t index), void *param, size_t count, unsigned threads) {
+	assert(job);
+	parallel_t p = { .job = job, .param = param, .count = count, .next = 0, .error = 0, };
+	const size_t n = threads < count ? threads : count;
+	pthread_t *ids = n > 1 ? malloc((n - 1) * sizeof *ids) : NULL;
+	size_t started = 0;
+	if (pthread_mutex_init(&p.lock, NULL)) {
+		free(ids);
+		return -1;
+	}
+	for (; ids && started < (n - 1); started++)
+		if (pthread_create(&ids[started], NULL, parallel_worker, &p))
+			break;
+	(void)parallel_worker(&p);
+	for (size_t i = 0; i < started; i++)
+		if (pthread_join(ids[i], NULL))
+			p.error = -1;
+	(void)pthread_mutex_destroy(&p.lock);
+	free(ids);
+	return p.next < p.count ? -1 : p.error;
+}
+#endif
+
 typedef struct {
 	FILE *handle;
+	void *map;
+	size_t map_length;
 	size_t length;
 	char buffer[];
 } file_t;
@@ -38,6 +280,13 @@ static cdb_word_t cdb_write_cb(void *file, void *buf, size_t length) {
 	return fwrite(buf, 1, length, ((file_t*)file)->handle);
 }
 
+static cdb_word_t cdb_read_at_cb(void *file, void *buf, size_t length, uint64_t offset) {
+	assert(file);
+	assert(buf);
+	assert(((file_t*)file)->handle);
+	return read_file_at(((file_t*)file)->handle, buf, length, offset);
+}
+
 static int cdb_seek_cb(void *file, uint64_t offset) {
 	assert(file);
 	assert(((file_t*)file)->handle);
@@ -46,9 +295,18 @@ static int cdb_seek_cb(void *file, uint64_t offset) {
 
 static void *cdb_open_cb(const char *name, int mode) {
 	assert(name);
-	assert(mode == CDB_RO_MODE || mode == CDB_RW_MODE);
-	const char *mode_string = mode == CDB_RW_MODE ? "wb+" : "rb";
-	FILE *f = fopen(name, mode_string);
+	assert(mode == CDB_RO_MODE || mode == CDB_RW_MODE || mode == CDB_TMP_MODE);
+	FILE *f = NULL;
+	if (mode == CDB_TMP_MODE) {
+#ifdef _WIN32 /* open files cannot be removed, put it wherever the C library wants */
+		f = tmpfile();
+#else /* next to the database, removed now so it is cleaned up however we exit */
+		if ((f = fopen(name, "wb+")))
+			(void)remove(name);
+#endif
+	} else {
+		f = fopen(name, mode == CDB_RW_MODE ? "wb+" : "rb");
+	}
 	if (!f)
 		return f;
 	const size_t length = 1024ul * 16ul;
@@ -58,6 +316,8 @@ static void *cdb_open_cb(const char *name, int mode) {
 		return NULL;
 	}
 	fb->handle = f;
+	fb->map    = NULL;
+	fb->map_length = 0;
 	fb->length = length;
 	if (setvbuf(f, fb->buffer, _IOFBF, fb->length) < 0) {
 		fclose(f);
@@ -70,7 +330,11 @@ static void *cdb_open_cb(const char *name, int mode) {
 static int cdb_close_cb(void *file) {
 	assert(file);
 	assert(((file_t*)file)->handle);
-	const int r = fclose(((file_t*)file)->handle);
+	int r = 0;
+	if (((file_t*)file)->map && unmap_file(((file_t*)file)->map, ((file_t*)file)->map_length) < 0)
+		r = -1;
+	if (fclose(((file_t*)file)->handle) < 0)
+		r = -1;
 	((file_t*)file)->handle = NULL;
 	free(file);
 	return r;
@@ -81,6 +345,1102 @@ static int cdb_flush_cb(void *file) {
 	return fflush(((file_t*)file)->handle);
 }
 
+static uint64_t cdb_ticks_cb(void) {
+	return ticks();
+}
+
+static int cdb_advise_cb(void *file, uint64_t offset, uint64_t length, int advice) {
+	assert(file);
+	file_t *f = file;
+	return advise_file(f->handle, f->map, f->map_length, offset, length, advice);
+}
+
+static int cdb_resident_cb(void *file, uint64_t offset, uint64_t length, uint64_t *bytes) {
+	assert(file);
+	return resident_file(((file_t*)file)->handle, offset, length, bytes);
+}
+
+static const void *cdb_map_cb(void *file, uint64_t *length) {
+	assert(file);
+	assert(length);
+	file_t *f = file;
+	assert(f->handle);
+	assert(f->map == NULL);
+	size_t l = 0;
+	f->map = map_file(f->handle, &l);
+	f->map_length = l;
+	*length = l;
+	return f->map;
+}
+
+static int cdb_parallel_cb(int (*job)(void *param, size_t index), void *param, size_t count, unsigned threads) {
+	assert(job);
+	return run_parallel(job, param, count, threads);
+}
+
+#if CDB_HOST_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+typedef struct {
+	int fd;
+	unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq, *cq;
+	size_t sq_length, cq_length, sqes_length;
+	unsigned queued; /* reads queued up but not yet submitted */
+} ring_t;
+
+static void ring_close(ring_t *r) {
+	assert(r);
+	if (r->sqes)
+		(void)munmap(r->sqes, r->sqes_length);
+	if (r->cq && r->cq != r->sq)
+		(void)munmap(r->cq, r->cq_length);
+	if (r->sq)
+		(void)munmap(r->sq, r->sq_length);
+	if (r->fd >= 0)
+		(void)close(r->fd);
+	memset(r, 0, sizeof (*r));
+	r->fd = -1;
+}
+
+/* There is no "liburing" here, the ring is set up with the system calls,
+ * which are simple enough for the one operation we need. */
+static int ring_open(ring_t *r, unsigned entries) {
+	assert(r);
+	memset(r, 0, sizeof (*r));
+	struct io_uring_params p;
+	memset(&p, 0, sizeof (p));
+	if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return -1;
+	r->sq_length = p.sq_off.array + (p.sq_entries * sizeof (unsigned));
+	r->cq_length = p.cq_off.cqes + (p.cq_entries * sizeof (struct io_uring_cqe));
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sq_length = r->cq_length = r->sq_length > r->cq_length ? r->sq_length : r->cq_length;
+	void *m = mmap(NULL, r->sq_length, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_SQ_RING);
+	if (m == MAP_FAILED)
+		goto fail;
+	r->sq = m;
+	r->cq = m;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		if ((m = mmap(NULL, r->cq_length, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+			goto fail;
+		r->cq = m;
+	}
+	r->sqes_length = p.sq_entries * sizeof (struct io_uring_sqe);
+	if ((m = mmap(NULL, r->sqes_length, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_SQES)) == MAP_FAILED)
+		goto fail;
+	r->sqes     = m;
+	r->sq_tail  = (unsigned *)((char *)r->sq + p.sq_off.tail);
+	r->sq_mask  = (unsigned *)((char *)r->sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq + p.sq_off.array);
+	r->cq_head  = (unsigned *)((char *)r->cq + p.cq_off.head);
+	r->cq_tail  = (unsigned *)((char *)r->cq + p.cq_off.tail);
+	r->cq_mask  = (unsigned *)((char *)r->cq + p.cq_off.ring_mask);
+	r->cqes     = (struct io_uring_cqe *)((char *)r->cq + p.cq_off.cqes);
+	return 0;
+fail:
+	ring_close(r);
+	return -1;
+}
+
+/* Never more reads are queued than there are entries, so this cannot fail */
+static void ring_read(ring_t *r, struct iovec *v, cdb_async_t *a, const uint64_t data) {
+	assert(r);
+	assert(v);
+	assert(a);
+	const unsigned tail = *r->sq_tail, index = tail & *r->sq_mask;
+	struct io_uring_sqe *e = &r->sqes[index];
+	memset(e, 0, sizeof (*e));
+	v->iov_base  = a->buffer;
+	v->iov_len   = a->length;
+	e->opcode    = IORING_OP_READV;
+	e->fd        = fileno(((file_t *)a->file)->handle);
+	e->addr      = (uintptr_t)v;
+	e->len       = 1;
+	e->off       = a->offset;
+	e->user_data = data;
+	r->sq_array[index] = index;
+	__atomic_store_n(r->sq_tail, tail + 1u, __ATOMIC_RELEASE);
+	r->queued++;
+}
+
+/* Submit everything queued and wait for at least one read to complete */
+static int ring_wait(ring_t *r) {
+	assert(r);
+	for (;;) {
+		const long n = syscall(__NR_io_uring_enter, r->fd, r->queued, 1u, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n >= 0) {
+			r->queued -= n;
+			return 0;
+		}
+		if (errno != EINTR)
+			return -1;
+	}
+}
+
+/* Returns the number found, negative on error, or -2 if io_uring cannot be used */
+static int lookup_ring(cdb_t *cdb, const cdb_buffer_t *keys, cdb_file_pos_t *values, const size_t count, const unsigned depth) {
+	assert(cdb);
+	ring_t ring;
+	if (ring_open(&ring, depth) < 0)
+		return -2;
+	cdb_async_t *as = malloc(depth * sizeof (*as));
+	struct iovec *vs = malloc(depth * sizeof (*vs));
+	size_t *index = malloc(depth * sizeof (*index));
+	unsigned *idle = malloc(depth * sizeof (*idle)), nidle = depth;
+	int found = 0, r = 0;
+	if (!as || !vs || !index || !idle) {
+		r = -1;
+		goto done;
+	}
+	for (unsigned i = 0; i < depth; i++)
+		idle[i] = i;
+	for (size_t next = 0; r == 0;) {
+		while (nidle && next < count) { /* start lookups until each has a read queued */
+			const unsigned s = idle[nidle - 1u];
+			const int g = cdb_async_start(cdb, &as[s], &keys[next], 0);
+			index[s] = next++;
+			if (g == CDB_ASYNC_READ) {
+				nidle--;
+				ring_read(&ring, &vs[s], &as[s], s);
+			} else if (g < 0) {
+				r = -1;
+				break;
+			} else {
+				values[index[s]] = as[s].value;
+				found += g == 1;
+			}
+		}
+		if (nidle == depth || r < 0)
+			break;
+		if (ring_wait(&ring) < 0) {
+			r = -1;
+			break;
+		}
+		unsigned head = *ring.cq_head;
+		for (const unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE); head != tail; head++) {
+			const struct io_uring_cqe *e = &ring.cqes[head & *ring.cq_mask];
+			const unsigned s = (unsigned)e->user_data;
+			const int g = r < 0 ? -1 : cdb_async_step(cdb, &as[s], e->res < 0 ? 0 : (size_t)e->res);
+			if (g == CDB_ASYNC_READ) {
+				ring_read(&ring, &vs[s], &as[s], s);
+				continue;
+			}
+			idle[nidle++] = s;
+			if (g < 0) {
+				r = -1;
+			} else {
+				values[index[s]] = as[s].value;
+				found += g == 1;
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	while (nidle < depth) { /* wait for any reads still going into "as" before freeing it */
+		if (ring_wait(&ring) < 0)
+			return -1; /* leaks, but the kernel may still be writing to "as" */
+		unsigned head = *ring.cq_head;
+		for (const unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE); head != tail; head++)
+			nidle++;
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+done:
+	ring_close(&ring);
+	free(as);
+	free(vs);
+	free(index);
+	free(idle);
+	return r < 0 ? r : found;
+}
+#endif
+
+typedef struct {
+	cdb_t *cdb;
+	const cdb_buffer_t *keys;
+	cdb_file_pos_t *values;
+	size_t count, slices;
+	int *found;
+} lookups_t;
+
+/* Each thread does its share of the lookups on a clone, one read at a time */
+static int lookup_slice(void *param, size_t index) {
+	lookups_t *p = param;
+	assert(p);
+	cdb_t *c = NULL;
+	if (cdb_clone(&c, p->cdb) < 0)
+		return -1;
+	const size_t each = (p->count + p->slices - 1u) / p->slices, start = index * each;
+	const size_t end = start + each < p->count ? start + each : p->count;
+	int r = 0, found = 0;
+	for (size_t i = start; i < end && r == 0; i++) {
+		cdb_async_t a;
+		int g = cdb_async_start(c, &a, &p->keys[i], 0);
+		while (g == CDB_ASYNC_READ)
+			g = cdb_async_step(c, &a, cdb_read_at_cb(a.file, a.buffer, a.length, a.offset));
+		if (g < 0)
+			r = -1;
+		p->values[i] = a.value;
+		found += g == 1;
+	}
+	p->found[index] = found;
+	return cdb_close(c) < 0 ? -1 : r;
+}
+
+int cdb_host_lookup_async(cdb_t *cdb, const cdb_buffer_t *keys, cdb_file_pos_t *values, size_t count, unsigned depth) {
+	assert(cdb);
+	assert(!count || keys);
+	assert(!count || values);
+	depth = depth ? depth : 1u;
+#if CDB_HOST_IO_URING
+	const int q = lookup_ring(cdb, keys, values, count, depth);
+	if (q != -2)
+		return q;
+#endif
+	const size_t slices = depth < count ? depth : count;
+	if (slices == 0)
+		return 0;
+	int *found = calloc(slices, sizeof (*found));
+	if (!found)
+		return -1;
+	lookups_t p = { .cdb = cdb, .keys = keys, .values = values, .count = count, .slices = slices, .found = found, };
+	int r = run_parallel(lookup_slice, &p, slices, slices), total = 0;
+	for (size_t i = 0; i < slices; i++)
+		total += found[i];
+	free(found);
+	return r < 0 ? -1 : total;
+}
+
+#if CDB_HOST_RELOAD
+#include <sys/stat.h>
+
+#define RELOAD_WARM_MS (10000ul) /* longest a replacement is given to be read in to memory */
+
+typedef struct { /* a database as it was when it was opened, with a clone of it for each reader */
+	cdb_t *cdb, **clones;
+} generation_t;
+
+typedef union { /* padded so that readers do not share cache lines */
+	generation_t *active; /* what a reader is using, NULL if it is not using anything */
+	char pad[64];
+} reader_t;
+
+typedef struct { /* a file that has been replaced differs in at least one of these */
+	uint64_t device, inode, size, modified;
+} identity_t;
+
+struct cdb_host_reload {
+	generation_t *current;
+	reader_t *readers;
+	unsigned count;
+	identity_t seen;
+	cdb_options_t ops;
+	char *file;
+};
+
+static int identify(const char *file, identity_t *id) {
+	assert(file);
+	assert(id);
+	struct stat st;
+	if (stat(file, &st) < 0)
+		return -1;
+	*id = (identity_t) { .device = st.st_dev, .inode = st.st_ino, .size = st.st_size, .modified = st.st_mtime, };
+	return 0;
+}
+
+static int generation_close(generation_t *g, const unsigned count) {
+	if (!g)
+		return 0;
+	int r = 0;
+	for (unsigned i = 0; g->clones && i < count; i++)
+		if (cdb_close(g->clones[i]) < 0)
+			r = -1;
+	if (cdb_close(g->cdb) < 0)
+		r = -1;
+	free(g->clones);
+	free(g);
+	return r;
+}
+
+/* Give the operating system a while to read in what was asked for with
+ * CDB_OPTION_WARM before a replacement is used, the old database is still
+ * being used until then */
+static void generation_warm(generation_t *g) {
+	assert(g);
+	for (unsigned long waited = 0; waited < RELOAD_WARM_MS; waited += 10ul) {
+		uint64_t resident = 0, length = 0;
+		if (cdb_warm_progress(g->cdb, &resident, &length) <= 0 || resident >= length)
+			return;
+		sleep_us(10000ul);
+	}
+}
+
+static generation_t *generation_open(const cdb_options_t *ops, const char *file, const unsigned count) {
+	assert(ops);
+	assert(file);
+	generation_t *g = calloc(1, sizeof (*g));
+	if (!g)
+		return NULL;
+	if (!(g->clones = calloc(count, sizeof (*g->clones))))
+		goto fail;
+	if (cdb_open(&g->cdb, ops, 0, file) < 0) {
+		g->cdb = NULL; /* already freed */
+		goto fail;
+	}
+	for (unsigned i = 0; i < count; i++)
+		if (cdb_clone(&g->clones[i], g->cdb) < 0)
+			goto fail;
+	return g;
+fail:
+	(void)generation_close(g, count);
+	return NULL;
+}
+
+int cdb_host_reload_open(cdb_host_reload_t **reload, const cdb_options_t *ops, const char *file, unsigned readers) {
+	assert(reload);
+	assert(ops);
+	assert(file);
+	*reload = NULL;
+	readers = readers ? readers : 1u;
+	const size_t l = strlen(file) + 1ul;
+	cdb_host_reload_t *r = calloc(1, sizeof (*r));
+	if (!r)
+		return -1;
+	r->ops   = *ops;
+	r->count = readers;
+	if (!(r->readers = calloc(readers, sizeof (*r->readers))) || !(r->file = malloc(l)))
+		goto fail;
+	memcpy(r->file, file, l);
+	(void)identify(file, &r->seen); /* if it is replaced just after this it is opened again later, which does no harm */
+	if (!(r->current = generation_open(ops, file, readers)))
+		goto fail;
+	*reload = r;
+	return 0;
+fail:
+	(void)cdb_host_reload_close(r);
+	return -1;
+}
+
+int cdb_host_reload_close(cdb_host_reload_t *r) {
+	if (!r)
+		return 0;
+	const int e = generation_close(r->current, r->count);
+	free(r->readers);
+	free(r->file);
+	free(r);
+	return e;
+}
+
+/* The reader says which generation it is about to use, then checks it is
+ * still the current one; if it is then "cdb_host_reload_check" will see
+ * the reader using it and will not close it until the reader is done. */
+cdb_t *cdb_host_reload_enter(cdb_host_reload_t *r, unsigned reader) {
+	assert(r);
+	assert(reader < r->count);
+	generation_t **active = &r->readers[reader].active;
+	assert(!*active);
+	for (;;) {
+		generation_t *g = __atomic_load_n(&r->current, __ATOMIC_SEQ_CST);
+		__atomic_store_n(active, g, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&r->current, __ATOMIC_SEQ_CST) == g)
+			return g->clones[reader];
+	}
+}
+
+void cdb_host_reload_leave(cdb_host_reload_t *r, unsigned reader) {
+	assert(r);
+	assert(reader < r->count);
+	__atomic_store_n(&r->readers[reader].active, NULL, __ATOMIC_RELEASE);
+}
+
+int cdb_host_reload_check(cdb_host_reload_t *r) {
+	assert(r);
+	identity_t id;
+	if (identify(r->file, &id) < 0 || !memcmp(&id, &r->seen, sizeof (id)))
+		return 0; /* unchanged, or gone (perhaps about to be replaced), either way keep what we have */
+	r->seen = id; /* a file that cannot be opened is not tried again until it changes */
+	generation_t *g = generation_open(&r->ops, r->file, r->count), *old = r->current;
+	if (!g)
+		return -1;
+	generation_warm(g);
+	__atomic_store_n(&r->current, g, __ATOMIC_SEQ_CST);
+	for (unsigned i = 0; i < r->count; i++) /* readers entering from now on get the new one */
+		while (__atomic_load_n(&r->readers[i].active, __ATOMIC_SEQ_CST) == old)
+			sleep_us(100ul);
+	return generation_close(old, r->count) < 0 ? -1 : 1;
+}
+#else
+int cdb_host_reload_open(cdb_host_reload_t **reload, const cdb_options_t *ops, const char *file, unsigned readers) {
+	UNUSED(ops);
+	UNUSED(file);
+	UNUSED(readers);
+	*reload = NULL;
+	return -1;
+}
+int cdb_host_reload_close(cdb_host_reload_t *r) { UNUSED(r); return 0; }
+cdb_t *cdb_host_reload_enter(cdb_host_reload_t *r, unsigned reader) { UNUSED(r); UNUSED(reader); return NULL; }
+void cdb_host_reload_leave(cdb_host_reload_t *r, unsigned reader) { UNUSED(r); UNUSED(reader); }
+int cdb_host_reload_check(cdb_host_reload_t *r) { UNUSED(r); return -1; }
+#endif
+
+#if CDB_HOST_SERVER && CDB_HOST_RELOAD
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SERVER_KEY_MAX     (250ul)           /* longest key allowed by the memcached protocol */
+#define SERVER_INPUT_MAX   (1024ul * 1024ul) /* longest request line, or binary request, accepted */
+#define SERVER_OUTPUT_HIGH (1024ul * 1024ul) /* requests are left waiting until the replies drop below this */
+#define SERVER_READ        (64ul * 1024ul)   /* bytes read from a connection at once */
+#define SERVER_EVENTS      (64)
+#define SERVER_POLL_MS     (250)             /* how often workers check if another has failed, and for replaced databases */
+
+enum { /* memcached binary protocol */
+	BINARY_REQUEST = 0x80, BINARY_RESPONSE = 0x81, BINARY_HEADER = 24,
+	BINARY_GET = 0x00, BINARY_QUIT = 0x07, BINARY_GETQ = 0x09, BINARY_NOOP = 0x0a, BINARY_VERSION = 0x0b,
+	BINARY_GETK = 0x0c, BINARY_GETKQ = 0x0d, BINARY_QUITQ = 0x17,
+	BINARY_OK = 0x00, BINARY_NOT_FOUND = 0x01, BINARY_TOO_LARGE = 0x03, BINARY_UNKNOWN = 0x81,
+};
+
+typedef struct {
+	char *data;
+	size_t used, size, start; /* bytes from "start" up to "used" are waiting to be handled, or sent */
+} server_buffer_t;
+
+typedef struct server_connection {
+	struct server_connection *next, *prev;
+	int in, out;                   /* the same socket, unless serving standard input and output */
+	server_buffer_t input, output;
+	uint64_t skip;                 /* bytes of data sent with a storage command still to be thrown away */
+	int closing,                   /* asked to close, once the replies have been sent */
+	    eof,                       /* nothing more will be read, close once everything has been handled */
+	    writing;                   /* waiting for the replies to be sent before reading any more */
+} server_connection_t;
+
+typedef struct {
+	cdb_host_reload_t **dbs;
+	size_t count;
+	unsigned threads;
+	int listener, failed;
+} server_t;
+
+static void server_enter(cdb_host_reload_t **dbs, const size_t count, cdb_t **cdbs, const unsigned reader) {
+	for (size_t i = 0; i < count; i++)
+		cdbs[i] = cdb_host_reload_enter(dbs[i], reader);
+}
+
+static void server_leave(cdb_host_reload_t **dbs, const size_t count, cdb_t **cdbs, const unsigned reader) {
+	for (size_t i = 0; i < count; i++) {
+		if (cdbs[i])
+			cdb_host_reload_leave(dbs[i], reader);
+		cdbs[i] = NULL;
+	}
+}
+
+static int buffer_reserve(server_buffer_t *b, const size_t more) {
+	assert(b);
+	if ((b->size - b->used) >= more)
+		return 0;
+	if (b->start) { /* move what is left down to the front first */
+		memmove(b->data, b->data + b->start, b->used - b->start);
+		b->used -= b->start;
+		b->start = 0;
+		if ((b->size - b->used) >= more)
+			return 0;
+	}
+	size_t size = b->size ? b->size : 4096ul;
+	while ((size - b->used) < more) {
+		if (size > (SIZE_MAX / 2ul))
+			return -1;
+		size *= 2ul;
+	}
+	char *d = realloc(b->data, size);
+	if (!d)
+		return -1;
+	b->data = d;
+	b->size = size;
+	return 0;
+}
+
+static int buffer_add(server_buffer_t *b, const void *data, const size_t length) {
+	assert(b);
+	assert(data || length == 0);
+	if (buffer_reserve(b, length) < 0)
+		return -1;
+	if (length)
+		memcpy(b->data + b->used, data, length);
+	b->used += length;
+	return 0;
+}
+
+static int buffer_printf(server_buffer_t *b, const char *fmt, ...) {
+	assert(b);
+	assert(fmt);
+	char line[SERVER_KEY_MAX + 128ul];
+	va_list ap;
+	va_start(ap, fmt);
+	const int n = vsnprintf(line, sizeof line, fmt, ap);
+	va_end(ap);
+	if (n < 0 || (size_t)n >= sizeof line)
+		return -1;
+	return buffer_add(b, line, n);
+}
+
+static void buffer_free(server_buffer_t *b) {
+	assert(b);
+	free(b->data);
+	memset(b, 0, sizeof (*b));
+}
+
+static const char *server_version(void) {
+	static char v[32];
+	unsigned long version = 0;
+	(void)cdb_version(&version);
+	(void)snprintf(v, sizeof v, "%lu.%lu.%lu", (version >> 16) & 0xFFul, (version >> 8) & 0xFFul, version & 0xFFul);
+	return v;
+}
+
+/* The databases are searched in order, the first that has the key wins */
+static int server_find(cdb_t **cdbs, const size_t count, const cdb_buffer_t *key, cdb_t **which, cdb_file_pos_t *value) {
+	assert(cdbs);
+	assert(key);
+	assert(which);
+	assert(value);
+	for (size_t i = 0; i < count; i++) {
+		const int g = cdb_get(cdbs[i], key, value);
+		if (g != 0) {
+			*which = cdbs[i];
+			return g;
+		}
+	}
+	return 0;
+}
+
+static int server_value(cdb_t *cdb, const cdb_file_pos_t *value, server_buffer_t *out) {
+	assert(cdb);
+	assert(value);
+	assert(out);
+	if (value->length > SIZE_MAX || buffer_reserve(out, value->length) < 0)
+		return -1;
+	if (cdb_seek(cdb, value->position) < 0 || cdb_read(cdb, out->data + out->used, value->length) < 0)
+		return -1;
+	out->used += value->length;
+	return 0;
+}
+
+static size_t server_token(const char *line, const size_t length, size_t *at, const char **token) {
+	assert(line);
+	assert(at);
+	assert(token);
+	while (*at < length && line[*at] == ' ')
+		(*at)++;
+	*token = line + *at;
+	const size_t start = *at;
+	while (*at < length && line[*at] != ' ')
+		(*at)++;
+	return *at - start;
+}
+
+static int server_is(const char *token, const size_t length, const char *name) {
+	return strlen(name) == length && !memcmp(token, name, length);
+}
+
+/* Handle one request line of the text protocol, "*used" is left at zero if
+ * the line is not all there yet. Only "get", "gets", "version" and "quit"
+ * do anything, storage commands are refused (after throwing away their
+ * data) as the databases cannot change. */
+static int server_text(cdb_t **cdbs, const size_t count, server_connection_t *c, const char *p, const size_t available, size_t *used) {
+	assert(cdbs);
+	assert(c);
+	assert(p);
+	assert(used);
+	const char *nl = memchr(p, '\n', available);
+	if (!nl)
+		return available >= SERVER_INPUT_MAX ? -1 : 0;
+	*used = (nl - p) + 1ul;
+	size_t length = nl - p, at = 0;
+	if (length && p[length - 1ul] == '\r')
+		length--;
+	server_buffer_t *out = &c->output;
+	const char *cmd = NULL, *t = NULL;
+	const size_t cl = server_token(p, length, &at, &cmd);
+	if (server_is(cmd, cl, "get") || server_is(cmd, cl, "gets")) {
+		const int unique = cl == 4ul;
+		size_t keys = 0;
+		for (size_t tl = 0, check = at; (tl = server_token(p, length, &check, &t));) /* before any "VALUE" is written */
+			if (tl > SERVER_KEY_MAX)
+				return buffer_printf(out, "CLIENT_ERROR bad command line format\r\n");
+		for (size_t tl = 0; (tl = server_token(p, length, &at, &t)); keys++) {
+			const cdb_buffer_t key = { .length = tl, .buffer = (char *)t, };
+			cdb_t *which = NULL;
+			cdb_file_pos_t value = { 0, 0, };
+			const int g = server_find(cdbs, count, &key, &which, &value);
+			if (g < 0)
+				return -1;
+			if (g == 0)
+				continue;
+			if (buffer_printf(out, unique ? "VALUE %.*s 0 %lu %lu\r\n" : "VALUE %.*s 0 %lu\r\n",
+					(int)tl, t, (unsigned long)value.length, (unsigned long)value.position) < 0)
+				return -1;
+			if (server_value(which, &value, out) < 0 || buffer_add(out, "\r\n", 2) < 0)
+				return -1;
+		}
+		return buffer_printf(out, keys ? "END\r\n" : "ERROR\r\n");
+	}
+	if (server_is(cmd, cl, "version"))
+		return buffer_printf(out, "VERSION %s\r\n", server_version());
+	if (server_is(cmd, cl, "quit")) {
+		c->closing = 1;
+		return 0;
+	}
+	const int cas = server_is(cmd, cl, "cas");
+	if (cas || server_is(cmd, cl, "set") || server_is(cmd, cl, "add") || server_is(cmd, cl, "replace")
+			|| server_is(cmd, cl, "append") || server_is(cmd, cl, "prepend")) {
+		size_t tl = 0;
+		for (int i = 0; i < 4; i++) /* key, flags, expiry time and then the length of the data */
+			tl = server_token(p, length, &at, &t);
+		char bytes[32] = { 0, };
+		char *end = NULL;
+		if (tl == 0 || tl >= sizeof bytes)
+			return buffer_printf(out, "CLIENT_ERROR bad command line format\r\n");
+		memcpy(bytes, t, tl);
+		const unsigned long long data = strtoull(bytes, &end, 10);
+		if (*end)
+			return buffer_printf(out, "CLIENT_ERROR bad command line format\r\n");
+		if (bytes[0] == '-' || data > SERVER_INPUT_MAX) /* "strtoull" takes "-1", which would lose track of the requests */
+			return buffer_printf(out, "CLIENT_ERROR bad data chunk\r\n");
+		c->skip = data + 2ull; /* and the line ending after it */
+		if (cas)
+			(void)server_token(p, length, &at, &t);
+		tl = server_token(p, length, &at, &t);
+		return server_is(t, tl, "noreply") ? 0 : buffer_printf(out, "SERVER_ERROR read only\r\n");
+	}
+	return buffer_printf(out, "ERROR\r\n");
+}
+
+static int server_binary_header(server_buffer_t *out, const uint8_t *request, const uint16_t key, const uint8_t extras, const uint16_t status, const uint64_t body, const uint64_t cas) {
+	assert(out);
+	assert(request);
+	uint8_t h[BINARY_HEADER] = { BINARY_RESPONSE, request[1], key >> 8, key & 0xFFu, extras, 0, status >> 8, status & 0xFFu, };
+	for (int i = 0; i < 4; i++) {
+		h[8 + i]  = body >> (24 - (8 * i));
+		h[12 + i] = request[12 + i]; /* opaque, sent back as is */
+	}
+	for (int i = 0; i < 8; i++)
+		h[16 + i] = cas >> (56 - (8 * i));
+	return buffer_add(out, h, sizeof h);
+}
+
+/* Handle one request of the binary protocol, which all start with a byte
+ * that no text command does. Only the "get" family, "noop", "version" and
+ * "quit" are known, quiet "get"s only reply if the key is found. */
+static int server_binary(cdb_t **cdbs, const size_t count, server_connection_t *c, const uint8_t *p, const size_t available, size_t *used) {
+	assert(cdbs);
+	assert(c);
+	assert(p);
+	assert(used);
+	if (available < BINARY_HEADER)
+		return 0;
+	const uint16_t kl = ((uint16_t)p[2] << 8) | p[3];
+	const uint8_t el = p[4], op = p[1];
+	const uint32_t body = ((uint32_t)p[8] << 24) | ((uint32_t)p[9] << 16) | ((uint32_t)p[10] << 8) | p[11];
+	if (body > SERVER_INPUT_MAX || ((uint32_t)kl + el) > body)
+		return -1;
+	if (available < (BINARY_HEADER + body))
+		return 0;
+	*used = BINARY_HEADER + body;
+	server_buffer_t *out = &c->output;
+	switch (op) {
+	case BINARY_GET: case BINARY_GETQ: case BINARY_GETK: case BINARY_GETKQ: {
+		const int quiet = op == BINARY_GETQ || op == BINARY_GETKQ, with_key = op == BINARY_GETK || op == BINARY_GETKQ;
+		const cdb_buffer_t key = { .length = kl, .buffer = (char *)p + BINARY_HEADER + el, };
+		const uint16_t rkl = with_key ? kl : 0;
+		cdb_t *which = NULL;
+		cdb_file_pos_t value = { 0, 0, };
+		const int g = server_find(cdbs, count, &key, &which, &value);
+		if (g < 0)
+			return -1;
+		if (g == 0) {
+			if (quiet)
+				return 0;
+			const char *m = with_key ? key.buffer : "Not found";
+			const size_t ml = with_key ? kl : strlen(m);
+			if (server_binary_header(out, p, rkl, 0, BINARY_NOT_FOUND, ml, 0) < 0)
+				return -1;
+			return buffer_add(out, m, ml);
+		}
+		const uint64_t total = 4ull + rkl + value.length;
+		if (total > UINT32_MAX) {
+			const char *m = "Too large";
+			if (server_binary_header(out, p, 0, 0, BINARY_TOO_LARGE, strlen(m), 0) < 0)
+				return -1;
+			return buffer_add(out, m, strlen(m));
+		}
+		static const uint8_t flags[4] = { 0, };
+		if (server_binary_header(out, p, rkl, sizeof flags, BINARY_OK, total, value.position) < 0)
+			return -1;
+		if (buffer_add(out, flags, sizeof flags) < 0 || buffer_add(out, key.buffer, rkl) < 0)
+			return -1;
+		return server_value(which, &value, out);
+	}
+	case BINARY_NOOP:
+		return server_binary_header(out, p, 0, 0, BINARY_OK, 0, 0);
+	case BINARY_VERSION: {
+		const char *v = server_version();
+		if (server_binary_header(out, p, 0, 0, BINARY_OK, strlen(v), 0) < 0)
+			return -1;
+		return buffer_add(out, v, strlen(v));
+	}
+	case BINARY_QUIT:
+	case BINARY_QUITQ:
+		c->closing = 1;
+		return op == BINARY_QUIT ? server_binary_header(out, p, 0, 0, BINARY_OK, 0, 0) : 0;
+	}
+	const char *m = "Unknown command";
+	if (server_binary_header(out, p, 0, 0, BINARY_UNKNOWN, strlen(m), 0) < 0)
+		return -1;
+	return buffer_add(out, m, strlen(m));
+}
+
+/* Handle the whole requests waiting in the input, of which there may be
+ * many as clients can send requests without waiting for the replies. This
+ * returns 1 if it stopped because too many replies are waiting to be sent,
+ * zero if it needs more input, and negative if the connection should be
+ * dropped (or a database has failed). */
+static int server_process(cdb_t **cdbs, const size_t count, server_connection_t *c) {
+	assert(cdbs);
+	assert(c);
+	server_buffer_t *in = &c->input;
+	while (!c->closing) {
+		if ((c->output.used - c->output.start) >= SERVER_OUTPUT_HIGH)
+			return 1;
+		const size_t available = in->used - in->start;
+		const char *p = in->data + in->start;
+		if (c->skip) {
+			const size_t n = c->skip < available ? c->skip : available;
+			in->start += n;
+			c->skip -= n;
+			if (c->skip)
+				return 0;
+			continue;
+		}
+		if (available == 0)
+			return 0;
+		size_t used = 0;
+		const int r = (uint8_t)p[0] == BINARY_REQUEST ?
+			server_binary(cdbs, count, c, (const uint8_t *)p, available, &used) :
+			server_text(cdbs, count, c, p, available, &used);
+		if (r < 0)
+			return -1;
+		if (used == 0)
+			return 0;
+		in->start += used;
+	}
+	return 0;
+}
+
+static int server_read(server_connection_t *c) {
+	assert(c);
+	server_buffer_t *in = &c->input;
+	if (in->start == in->used)
+		in->start = in->used = 0;
+	if (buffer_reserve(in, SERVER_READ) < 0)
+		return -1;
+	const ssize_t n = read(c->in, in->data + in->used, SERVER_READ);
+	if (n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 1 : -1;
+	in->used += n;
+	return n ? 1 : 0;
+}
+
+/* Returns 1 if everything was sent, 0 if the socket is full */
+static int server_write(server_connection_t *c) {
+	assert(c);
+	server_buffer_t *out = &c->output;
+	while (out->start < out->used) {
+		const ssize_t n = c->in == c->out ?
+			send(c->out, out->data + out->start, out->used - out->start, MSG_NOSIGNAL) :
+			write(c->out, out->data + out->start, out->used - out->start);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		out->start += n;
+	}
+	out->start = out->used = 0;
+	return 1;
+}
+
+static void server_close(server_connection_t *c) {
+	assert(c);
+	if (c->in >= 0 && c->in == c->out)
+		(void)close(c->in);
+	buffer_free(&c->input);
+	buffer_free(&c->output);
+	free(c);
+}
+
+/* Serve one client on standard input and output, as "inetd" would have,
+ * the databases are checked for being replaced before handling any input */
+static int server_stdio(cdb_host_reload_t **dbs, const size_t count) {
+	server_connection_t c = { .in = STDIN_FILENO, .out = STDOUT_FILENO, };
+	cdb_t **cdbs = calloc(count, sizeof (*cdbs));
+	int r = 0;
+	if (!cdbs)
+		return -1;
+	for (;;) {
+		for (size_t i = 0; i < count; i++)
+			(void)cdb_host_reload_check(dbs[i]);
+		server_enter(dbs, count, cdbs, 0);
+		const int p = server_process(cdbs, count, &c);
+		server_leave(dbs, count, cdbs, 0);
+		if (p < 0 || server_write(&c) < 0) {
+			r = -1;
+			break;
+		}
+		if (c.closing)
+			break;
+		if (p > 0)
+			continue;
+		const int g = server_read(&c);
+		if (g <= 0) {
+			r = g;
+			break;
+		}
+	}
+	buffer_free(&c.input);
+	buffer_free(&c.output);
+	free(cdbs);
+	return r;
+}
+
+/* Handle an event on a connection, returns 1 to keep it, 0 to close it,
+ * and negative if a database has failed */
+static int server_event(server_t *s, cdb_t **cdbs, const int epoll, server_connection_t *c, const uint32_t events) {
+	assert(s);
+	assert(c);
+	if (events & EPOLLERR)
+		return 0;
+	if (events & (EPOLLIN | EPOLLHUP)) {
+		const int g = server_read(c);
+		if (g < 0)
+			return 0;
+		c->eof = g == 0;
+	}
+	int writing = 0;
+	for (;;) {
+		const int p = server_process(cdbs, s->count, c);
+		if (p < 0) { /* a bad request drops the connection, a failed database stops the server */
+			for (size_t i = 0; i < s->count; i++)
+				if (cdb_status(cdbs[i]) < 0)
+					return -1;
+			return 0;
+		}
+		const int w = server_write(c);
+		if (w < 0)
+			return 0;
+		if (w == 0 || p == 0) {
+			writing = w == 0;
+			break;
+		}
+	}
+	if ((c->closing || c->eof) && !writing)
+		return 0;
+	if (writing == c->writing)
+		return 1;
+	c->writing = writing;
+	struct epoll_event e = { .events = writing ? EPOLLOUT : EPOLLIN, .data.ptr = c, }; /* stop reading until the replies are sent */
+	return epoll_ctl(epoll, EPOLL_CTL_MOD, c->in, &e) < 0 ? 0 : 1;
+}
+
+static void server_accept(const int listener, const int epoll, server_connection_t **connections) {
+	assert(connections);
+	const int fd = accept(listener, NULL, NULL);
+	if (fd < 0)
+		return;
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+		(void)close(fd);
+		return;
+	}
+	server_connection_t *c = calloc(1, sizeof (*c));
+	if (!c) {
+		(void)close(fd);
+		return;
+	}
+	c->in = c->out = fd;
+	struct epoll_event e = { .events = EPOLLIN, .data.ptr = c, };
+	if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &e) < 0) {
+		server_close(c);
+		return;
+	}
+	c->next = *connections;
+	if (c->next)
+		c->next->prev = c;
+	*connections = c;
+}
+
+/* Each worker has its own clones of the databases, its own "epoll" set,
+ * and takes its turn accepting connections, which it then keeps. The
+ * clones in use are only swapped for those of a replacement database
+ * between batches of events. */
+static int server_worker(server_t *s, const unsigned index) {
+	assert(s);
+	int r = -1, epoll = -1;
+	server_connection_t *connections = NULL;
+	cdb_t **cdbs = calloc(s->count, sizeof (*cdbs));
+	if (!cdbs)
+		goto done;
+	if ((epoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		goto done;
+	struct epoll_event e = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL, };
+	if (epoll_ctl(epoll, EPOLL_CTL_ADD, s->listener, &e) < 0)
+		goto done;
+	while (!__atomic_load_n(&s->failed, __ATOMIC_RELAXED)) {
+		struct epoll_event events[SERVER_EVENTS];
+		const int n = epoll_wait(epoll, events, SERVER_EVENTS, SERVER_POLL_MS);
+		if (n < 0 && errno != EINTR)
+			goto done;
+		server_enter(s->dbs, s->count, cdbs, index);
+		for (int i = 0; i < n; i++) {
+			server_connection_t *c = events[i].data.ptr;
+			if (!c) {
+				server_accept(s->listener, epoll, &connections);
+				continue;
+			}
+			const int g = server_event(s, cdbs, epoll, c, events[i].events);
+			if (g < 0)
+				goto done;
+			if (g > 0)
+				continue;
+			if (c->prev)
+				c->prev->next = c->next;
+			else
+				connections = c->next;
+			if (c->next)
+				c->next->prev = c->prev;
+			server_close(c); /* closing the socket also takes it out of the "epoll" set */
+		}
+		server_leave(s->dbs, s->count, cdbs, index);
+	}
+	r = 0;
+done:
+	if (r < 0)
+		__atomic_store_n(&s->failed, 1, __ATOMIC_RELAXED);
+	while (connections) {
+		server_connection_t *next = connections->next;
+		server_close(connections);
+		connections = next;
+	}
+	if (epoll >= 0)
+		(void)close(epoll);
+	if (cdbs)
+		server_leave(s->dbs, s->count, cdbs, index);
+	free(cdbs);
+	return r;
+}
+
+/* Replacements that cannot be opened are ignored, the old database is kept */
+static int server_reloader(server_t *s) {
+	assert(s);
+	while (!__atomic_load_n(&s->failed, __ATOMIC_RELAXED)) {
+		const struct timespec t = { .tv_sec = 0, .tv_nsec = SERVER_POLL_MS * 1000000l, };
+		(void)nanosleep(&t, NULL);
+		for (size_t i = 0; i < s->count; i++)
+			(void)cdb_host_reload_check(s->dbs[i]);
+	}
+	return 0;
+}
+
+static int server_job(void *param, size_t index) {
+	server_t *s = param;
+	assert(s);
+	return index < s->threads ? server_worker(s, index) : server_reloader(s);
+}
+
+/* "address" is a path if it has a '/' in it, otherwise "[host:]port" */
+static int server_listen(const char *address) {
+	assert(address);
+	int fd = -1;
+	if (strchr(address, '/')) {
+		struct sockaddr_un a = { .sun_family = AF_UNIX, };
+		struct stat st;
+		if (strlen(address) >= sizeof (a.sun_path))
+			return -1;
+		strcpy(a.sun_path, address);
+		if (stat(address, &st) == 0 && S_ISSOCK(st.st_mode)) /* left behind by an earlier server */
+			(void)unlink(address);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+			return -1;
+		if (bind(fd, (struct sockaddr *)&a, sizeof a) < 0 || listen(fd, SOMAXCONN) < 0) {
+			(void)close(fd);
+			return -1;
+		}
+		return fd;
+	}
+	char host[256] = { 0, };
+	const char *port = strrchr(address, ':');
+	if (port) {
+		size_t l = port - address;
+		const char *h = address;
+		if (l >= 2 && h[0] == '[' && h[l - 1] == ']') { /* IPv6 */
+			h++;
+			l -= 2;
+		}
+		if (l >= sizeof host)
+			return -1;
+		memcpy(host, h, l);
+		port++;
+	} else {
+		port = address;
+	}
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE, }, *ai = NULL;
+	if (getaddrinfo(host[0] ? host : NULL, port, &hints, &ai) != 0)
+		return -1;
+	for (struct addrinfo *a = ai; a; a = a->ai_next) {
+		if ((fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol)) < 0)
+			continue;
+		const int on = 1;
+		(void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+		if (bind(fd, a->ai_addr, a->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0)
+			break;
+		(void)close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+int cdb_host_serve(cdb_host_reload_t **dbs, size_t count, const char *address, unsigned threads) {
+	assert(dbs);
+	assert(address);
+	if (count == 0)
+		return -1;
+	if (!strcmp(address, "-"))
+		return server_stdio(dbs, count);
+	threads = threads ? threads : 1u;
+	server_t s = { .dbs = dbs, .count = count, .threads = threads, .listener = server_listen(address), .failed = 0, };
+	if (s.listener < 0)
+		return -1;
+	const int r = run_parallel(server_job, &s, threads + 1u, threads + 1u); /* and one more to check for replaced databases */
+	(void)close(s.listener);
+	return r;
+}
+#else
+int cdb_host_serve(cdb_host_reload_t **dbs, size_t count, const char *address, unsigned threads) {
+	UNUSED(dbs);
+	UNUSED(count);
+	UNUSED(address);
+	UNUSED(threads);
+	return -1;
+}
+#endif
+
 const cdb_options_t cdb_host_options = {
 	.allocator = cdb_allocator_cb,
 	.hash      = NULL,
@@ -94,5 +1454,34 @@ const cdb_options_t cdb_host_options = {
 	.arena     = NULL,
 	.offset    = 0,
 	.size      = 0, /* auto-select */
+	.read_at   = cdb_read_at_cb,
+	.buffer    = 1024ul * 1024ul, /* gather up writes into large chunks when creating */
+	.parallel  = cdb_parallel_cb,
+	.threads   = 0, /* do not use threads unless asked to */
+	.ticks     = cdb_ticks_cb, /* only used if the library keeps counters */
+	.advise    = cdb_advise_cb, /* only used with the CDB_OPTION_WARM* and CDB_OPTION_RANDOM flags */
+	.resident  = cdb_resident_cb,
 };
 
+const cdb_options_t cdb_mmap_options = {
+	.allocator = cdb_allocator_cb,
+	.hash      = NULL,
+	.compare   = NULL,
+	.read      = cdb_read_cb,
+	.write     = cdb_write_cb,
+	.seek      = cdb_seek_cb,
+	.open      = cdb_open_cb,
+	.close     = cdb_close_cb,
+	.flush     = cdb_flush_cb,
+	.arena     = NULL,
+	.offset    = 0,
+	.size      = 0, /* auto-select */
+	.map       = cdb_map_cb,
+	.read_at   = cdb_read_at_cb,
+	.buffer    = 1024ul * 1024ul, /* gather up writes into large chunks when creating */
+	.parallel  = cdb_parallel_cb,
+	.threads   = 0, /* do not use threads unless asked to */
+	.ticks     = cdb_ticks_cb, /* only used if the library keeps counters */
+	.advise    = cdb_advise_cb, /* only used with the CDB_OPTION_WARM* and CDB_OPTION_RANDOM flags */
+	.resident  = cdb_resident_cb,
+};
@@ -4,5 +4,45 @@
 #include "cdb.h"
 
 extern const cdb_options_t cdb_host_options;
+extern const cdb_options_t cdb_mmap_options; /* as above, but the database is memory mapped when reading */
+
+/* Look up "count" keys with up to "depth" of them going at once, for a
+ * database opened with the options above. The reads are queued up with
+ * io_uring where it can be used, otherwise "depth" threads do a share of
+ * the lookups each. This returns the number found, negative on error, the
+ * "values" are as for "cdb_lookup_batch". */
+int cdb_host_lookup_async(cdb_t *cdb, const cdb_buffer_t *keys, cdb_file_pos_t *values, size_t count, unsigned depth);
+
+/* A database that can be swapped for a new file put in its place (with
+ * "rename", say) while other threads are using it. Each of up to "readers"
+ * threads gets its own clone of the database with "cdb_host_reload_enter",
+ * which it must give back with "cdb_host_reload_leave" before entering
+ * again, neither call takes a lock. "cdb_host_reload_check" (called from
+ * one thread only, and not between entering and leaving) looks to see if
+ * the file has changed and if so opens the new one, which readers entering
+ * from then on get (once it has been read in to memory, or ten seconds have
+ * passed, if CDB_OPTION_WARM or CDB_OPTION_WARM_ALL are set), and closes
+ * the old one after the readers still using it have left. It returns 1 if
+ * it swapped, 0 if nothing changed or the file has gone, and negative if
+ * the new file could not be opened, in which case the old one is kept. Only
+ * available with GCC or Clang, as it uses atomics. */
+typedef struct cdb_host_reload cdb_host_reload_t;
+int cdb_host_reload_open(cdb_host_reload_t **reload, const cdb_options_t *ops, const char *file, unsigned readers);
+int cdb_host_reload_close(cdb_host_reload_t *reload);
+cdb_t *cdb_host_reload_enter(cdb_host_reload_t *reload, unsigned reader);
+void cdb_host_reload_leave(cdb_host_reload_t *reload, unsigned reader);
+int cdb_host_reload_check(cdb_host_reload_t *reload);
+
+/* Serve "get" and "gets" (and their binary protocol equivalents) from the
+ * "count" databases, opened with at least "threads" readers, to clients
+ * speaking the memcached protocol. A key is looked for in each database in
+ * turn, and the databases are checked for being replaced a few times a
+ * second (or before any input is handled, for "-"). "address" is a Unix
+ * socket if it has a '/' in it, "[host:]port" for TCP, or "-" to serve a
+ * single client on standard input and output. "threads" workers each handle
+ * their own connections with clones of the databases. This only returns on
+ * error, which includes a database failing, or at the end of input for "-".
+ * Only available on Linux, as it uses "epoll", elsewhere it always fails. */
+int cdb_host_serve(cdb_host_reload_t **dbs, size_t count, const char *address, unsigned threads);
 
 #endif
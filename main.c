@@ -19,7 +19,13 @@
 #define MIN(X, Y)      ((X) < (Y) ? (X) : (Y))
 #define MAX(X, Y)      ((X) > (Y) ? (X) : (Y))
 #define IO_BUFFER_SIZE (1024u)
+#define IO_STREAM_SIZE (64ul * 1024ul)           /* buffer size for stdin and stdout */
 #define DISTMAX        (10ul)
+#define QUERY_BATCH    (256ul)
+#define LOAD_CHUNK     (1ul * 1024ul * 1024ul) /* input is read in chunks of at least this size by "cdb_create" */
+#define LOAD_BATCH     (64ul * 1024ul)          /* maximum number of records given to "cdb_add_batch" at once */
+#define DUMP_RANGE     (4ul * 1024ul * 1024ul)  /* rough number of bytes of records each thread dumps at a time */
+#define FILTER_EXT     ".filter"                /* name of a filter is that of its database plus this, as in "cdb.c" */
 
 #ifdef _WIN32 /* Used to unfuck file mode for "Win"dows. Text mode is for losers. */
 #include <windows.h>
@@ -38,6 +44,22 @@ typedef struct {
 	unsigned long hash_start;
 } cdb_statistics_t;
 
+typedef struct {
+	char *b;        /* output waiting to be written */
+	size_t used,    /* bytes of 'b' in use */
+	       length;  /* bytes allocated for 'b' */
+	FILE *output;   /* 'b' is written here when it is full, if NULL it grows instead */
+} sink_t; /* dumps go through this so that they can be made in memory on many threads at once */
+
+typedef struct {
+	cdb_t *cdb;                   /* the ranges are done on clones of this handle */
+	const cdb_word_t *boundaries; /* ranges of records from "cdb_partition" */
+	size_t first;                 /* first range of this lot */
+	cdb_callback cb;              /* called for each record */
+	char *params;                 /* parameter passed to "cb" for each range in a lot */
+	size_t size;                  /* size of each parameter in 'params' */
+} ranges_t;
+
 typedef struct {
 	char *arg;   /* parsed argument */
 	int error,   /* turn error reporting on/off */
@@ -63,6 +85,40 @@ static void info(const char *fmt, ...) {
 	(void)fflush(out);
 }
 
+/* Only the buckets in use are printed, bucket "i" is for 2^(i-1) to 2^i - 1 */
+static void histogram(const char *name, const char *unit, const uint64_t *buckets) {
+	assert(name);
+	assert(unit);
+	assert(buckets);
+	for (unsigned i = 0; i < CDB_STATS_BUCKETS; i++) {
+		if (buckets[i] == 0)
+			continue;
+		const unsigned long lo = i ? 1ul << (i - 1u) : 0ul, hi = i ? (1ul << i) - 1ul : 0ul;
+		if (i == (CDB_STATS_BUCKETS - 1u))
+			info("%s %lu+ %s: %lu", name, lo, unit, (unsigned long)buckets[i]);
+		else
+			info("%s %lu-%lu %s: %lu", name, lo, hi, unit, (unsigned long)buckets[i]);
+	}
+}
+
+static void stats_print(const cdb_stats_t *s) {
+	assert(s);
+	info("seeks %lu, reads %lu, bytes read %lu", (unsigned long)s->seeks, (unsigned long)s->reads, (unsigned long)s->bytes);
+	info("lookups %lu, found %lu, slots probed %lu (at most %lu for one lookup), collisions %lu",
+		(unsigned long)s->lookups, (unsigned long)s->found, (unsigned long)s->probes,
+		(unsigned long)s->probes_max, (unsigned long)s->collisions);
+	histogram("probe length", "slots", s->probe_histogram);
+	histogram("lookup time", "ns", s->latency_histogram);
+}
+
+static void warm_print(cdb_t *cdb) {
+	assert(cdb);
+	uint64_t resident = 0, length = 0;
+	if (cdb_warm_progress(cdb, &resident, &length) > 0)
+		info("warmed %lu of %lu bytes (%lu%%)", (unsigned long)resident, (unsigned long)length,
+			(unsigned long)(length ? (resident * 100u) / length : 100u));
+}
+
 static void die(const char *fmt, ...) {
 	assert(fmt);
 	FILE *out = stderr;
@@ -141,22 +197,60 @@ static int cdb_getopt(cdb_getopt_t *opt, const int argc, char *const argv[], con
 	return opt->option; /* dump back option letter */
 }
 
-static int cdb_print(cdb_t *cdb, const cdb_file_pos_t *fp, FILE *output) {
+static int sink_flush(sink_t *s, FILE *output) {
+	assert(s);
+	assert(output);
+	const size_t used = s->used;
+	s->used = 0;
+	return used && fwrite(s->b, 1, used, output) != used ? -1 : 0;
+}
+
+static int sink_write(sink_t *s, const void *p, const size_t length) {
+	assert(s);
+	assert(p);
+	if (length == 0)
+		return 0;
+	if ((s->length - s->used) < length) {
+		if (s->output) {
+			if (sink_flush(s, s->output) < 0)
+				return -1;
+			if (length >= s->length)
+				return fwrite(p, 1, length, s->output) != length ? -1 : 0;
+		} else {
+			const size_t n = MAX(s->length * 2ul, s->used + length);
+			if (n < s->used + length)
+				return -1;
+			char *b = realloc(s->b, n);
+			if (!b)
+				return -1;
+			s->b = b;
+			s->length = n;
+		}
+	}
+	memcpy(s->b + s->used, p, length);
+	s->used += length;
+	return 0;
+}
+
+static int cdb_print(cdb_t *cdb, const cdb_file_pos_t *fp, sink_t *output) {
 	assert(cdb);
 	assert(fp);
 	assert(output);
+	const void *p = NULL;
+	const int m = cdb_pointer(cdb, fp, &p);
+	if (m < 0)
+		return -1;
+	if (m > 0) /* memory mapped or read ahead, no need to copy */
+		return sink_write(output, p, fp->length);
 	if (cdb_seek(cdb, fp->position) < 0)
 		return -1;
 	char buf[IO_BUFFER_SIZE];
 	const size_t length = fp->length;
 	for (size_t i = 0; i < length; i += sizeof buf) { /* N.B. Double buffering! */
-		const size_t l = length - i;
-		if (l > sizeof buf)
+		const size_t l = MIN(sizeof buf, length - i);
+		if (cdb_read(cdb, buf, l) < 0)
 			return -1;
-		assert(l <= sizeof buf);
-		if (cdb_read(cdb, buf, MIN(sizeof buf, l)) < 0)
-			return -1;
-		if (fwrite(buf, 1, l, output) != l)
+		if (sink_write(output, buf, l) < 0)
 			return -1;
 	}
 	return 0;
@@ -195,25 +289,23 @@ static int cdb_dump(cdb_t *cdb, const cdb_file_pos_t *key, const cdb_file_pos_t
 	assert(key);
 	assert(value);
 	assert(param);
-	FILE *output = param;
-	char kstr[64+2], vstr[64+2]; /* NOT INITIALIZED */
-	kstr[0] = '+';
-	const unsigned kl = cdb_number_to_string(kstr + 1, key->length, 10) + 1;
-	vstr[0] = ',';
-	const unsigned nl = cdb_number_to_string(vstr + 1, value->length, 10) + 1;
-	if (fwrite(kstr, 1, kl, output) != kl)
-		return -1;
-	vstr[nl]     = ':';
-	vstr[nl + 1] = '\0';
-	if (fwrite(vstr, 1, nl + 1, output) != (nl + 1))
+	sink_t *output = param;
+	char h[(2 * 64) + 4]; /* NOT INITIALIZED */
+	unsigned hl = 0;
+	h[hl++] = '+';
+	hl += cdb_number_to_string(h + hl, key->length, 10);
+	h[hl++] = ',';
+	hl += cdb_number_to_string(h + hl, value->length, 10);
+	h[hl++] = ':';
+	if (sink_write(output, h, hl) < 0)
 		return -1;
 	if (cdb_print(cdb, key, output) < 0)
 		return -1;
-	if (fwrite("->", 1, 2, output) != 2)
+	if (sink_write(output, "->", 2) < 0)
 		return -1;
 	if (cdb_print(cdb, value, output) < 0)
 		return -1;
-	return fputc('\n', output) != '\n' ? -1 : 0;
+	return sink_write(output, "\n", 1);
 }
 
 static int cdb_dump_keys(cdb_t *cdb, const cdb_file_pos_t *key, const cdb_file_pos_t *value, void *param) {
@@ -222,17 +314,107 @@ static int cdb_dump_keys(cdb_t *cdb, const cdb_file_pos_t *key, const cdb_file_p
 	assert(value);
 	assert(param);
 	UNUSED(value);
-	FILE *output = param;
+	sink_t *output = param;
 	char kstr[64+2]; /* NOT INITIALIZED */
 	kstr[0] = '+';
 	const unsigned kl = cdb_number_to_string(kstr + 1, key->length, 10) + 1;
 	kstr[kl]     = ':';
 	kstr[kl + 1] = '\0';
-	if (fwrite(kstr, 1, kl + 1, output) != (kl + 1))
+	if (sink_write(output, kstr, kl + 1) < 0)
 		return -1;
 	if (cdb_print(cdb, key, output) < 0)
 		return -1;
-	return fputc('\n', output) != '\n' ? -1 : 0;
+	return sink_write(output, "\n", 1);
+}
+
+static int ranges_job(void *param, size_t index) {
+	ranges_t *r = param;
+	assert(r);
+	cdb_t *clone = NULL;
+	if (cdb_clone(&clone, r->cdb) < 0)
+		return -1;
+	const size_t i = r->first + index;
+	const int e = cdb_foreach_range(clone, r->boundaries[i], r->boundaries[i + 1], r->cb, r->params ? r->params + (index * r->size) : NULL);
+	return cdb_close(clone) < 0 || e < 0 ? -1 : 0;
+}
+
+/* Call "cb" for each record, with the records split into ranges that are
+ * done "threads" at a time on clones of "cdb". Each range in a lot gets its
+ * own parameter from "params", there must be "threads" of them, and "done"
+ * is called after each lot with the number of ranges that were in it. */
+static int foreach_parallel(cdb_t *cdb, const cdb_options_t *ops, size_t ranges, cdb_callback cb, void *params, size_t size, int (*done)(void *params, size_t count)) {
+	assert(cdb);
+	assert(ops);
+	assert(ops->parallel);
+	const size_t threads = ops->threads;
+	assert(threads > 1 && ranges >= 1);
+	int r = 0;
+	cdb_word_t *boundaries = malloc((ranges + 1) * sizeof *boundaries);
+	if (!boundaries || cdb_partition(cdb, boundaries, ranges) < 0)
+		goto fail;
+	ranges_t rs = { .cdb = cdb, .boundaries = boundaries, .first = 0, .cb = cb, .params = params, .size = size, };
+	for (; rs.first < ranges; rs.first += threads) {
+		const size_t count = MIN(threads, ranges - rs.first);
+		if (ops->parallel(ranges_job, &rs, count, ops->threads) < 0)
+			goto fail;
+		if (done && done(params, count) < 0)
+			goto fail;
+	}
+	goto end;
+fail:
+	r = -1;
+end:
+	free(boundaries);
+	return r;
+}
+
+static int dump_done(void *params, size_t count) {
+	sink_t *sinks = params;
+	assert(sinks);
+	for (size_t i = 0; i < count; i++)
+		if (sink_flush(&sinks[i], stdout) < 0)
+			return -1;
+	return 0;
+}
+
+/* Dump the database in order, with "-j" the records are split up into
+ * ranges that are formatted into memory on many threads at once and then
+ * written out in order. */
+static int dump(cdb_t *cdb, const cdb_options_t *ops, cdb_callback cb) {
+	assert(cdb);
+	assert(ops);
+	assert(cb);
+	int r = 0;
+	const size_t threads = ops->parallel && ops->threads > 1 ? ops->threads : 1;
+	sink_t *sinks = calloc(threads, sizeof *sinks);
+	if (!sinks)
+		return -1;
+	if (threads == 1) {
+		sinks[0].output = stdout;
+		sinks[0].length = IO_STREAM_SIZE;
+		if (!(sinks[0].b = malloc(sinks[0].length)))
+			goto fail;
+		if (cdb_foreach(cdb, cb, &sinks[0]) < 0 || sink_flush(&sinks[0], stdout) < 0)
+			goto fail;
+	} else {
+		cdb_word_t b[2] = { 0, };
+		if (cdb_partition(cdb, b, 1) < 0) /* to find out how many bytes of records there are */
+			goto fail;
+		size_t ranges = ((b[1] - b[0]) / DUMP_RANGE) + 1;
+		ranges = ((ranges + threads - 1) / threads) * threads;
+		if (foreach_parallel(cdb, ops, ranges, cb, sinks, sizeof *sinks, dump_done) < 0)
+			goto fail;
+	}
+	if (fputc('\n', stdout) < 0)
+		goto fail;
+	goto end;
+fail:
+	r = -1;
+end:
+	for (size_t i = 0; i < threads; i++)
+		free(sinks[i].b);
+	free(sinks);
+	return r;
 }
 
 static int cdb_string_to_number(const char *s, cdb_word_t *out) {
@@ -273,81 +455,136 @@ static int scan(FILE *input, cdb_word_t *out, int delim) {
 	return cdb_string_to_number(b, out);
 }
 
+/* Parse a number terminated by "delim" from "b", returns 1 on success, 0
+ * if more input is needed, and -1 on error. */
+static int parse_number(const char *b, const size_t length, size_t *i, cdb_word_t *out, int delim) {
+	assert(b);
+	assert(i);
+	assert(out);
+	cdb_word_t n = 0;
+	size_t j = *i;
+	for (; j < length; j++) {
+		const unsigned digit = (unsigned char)b[j] - (unsigned)'0';
+		if (digit > 9)
+			break;
+		const cdb_word_t m = (n * (cdb_word_t)10ul) + digit;
+		if ((m - digit) / (cdb_word_t)10ul != n)
+			return -1;
+		n = m;
+	}
+	if (j >= length)
+		return 0;
+	if (j == *i || b[j] != delim)
+		return -1;
+	*i = j + 1ul;
+	*out = n;
+	return 1;
+}
+
+/* Parse one "+key-length,value-length:key->value" record from memory. It
+ * returns 1 and sets "next" to the start of the next record when a record is
+ * found, 0 if more input is needed (or there is nothing but white space left),
+ * and -1 on a parse error. */
+static int parse_record(const char *b, const size_t length, const int eof, cdb_buffer_t *key, cdb_buffer_t *value, size_t *next) {
+	assert(b);
+	assert(key);
+	assert(value);
+	assert(next);
+	size_t i = 0;
+	cdb_word_t klen = 0, vlen = 0;
+	int r = 0;
+	while (i < length && isspace((unsigned char)b[i]))
+		i++;
+	if (i >= length)
+		return 0;
+	if (b[i++] != '+')
+		return -1;
+	if ((r = parse_number(b, length, &i, &klen, ',')) <= 0)
+		return r;
+	if ((r = parse_number(b, length, &i, &vlen, ':')) <= 0)
+		return r;
+	if (klen > length || vlen > length || (i + klen + 2ul + vlen) > length) /* not all here yet */
+		return 0;
+	key->buffer = (char*)b + i;
+	key->length = klen;
+	i += klen;
+	if (b[i] != '-' || b[i + 1] != '>')
+		return -1;
+	i += 2;
+	value->buffer = (char*)b + i;
+	value->length = vlen;
+	i += vlen;
+	if (i == length) {
+		if (!eof)
+			return 0;
+	} else if (b[i] == '\n') {
+		i++;
+	} else if (b[i] == '\r') {
+		if ((i + 1) == length)
+			return eof ? -1 : 0;
+		if (b[i + 1] != '\n')
+			return -1;
+		i += 2;
+	} else {
+		return -1;
+	}
+	*next = i;
+	return 1;
+}
+
+/* The input is read in large chunks and parsed in place, the keys and values
+ * are passed to the library straight out of the chunk, in batches, which
+ * allows the library to do some of the work on other threads. */
 static int cdb_create(cdb_t *cdb, FILE *input) {
 	assert(cdb);
 	assert(input);
-
-	int r = 0;
-	size_t kmlen = IO_BUFFER_SIZE, vmlen = IO_BUFFER_SIZE;
-	char *key = malloc(kmlen);
-	char *value = malloc(vmlen);
-	if (!key || !value)
+	int r = 0, eof = 0;
+	size_t capacity = LOAD_CHUNK, used = 0;
+	char *b = malloc(capacity);
+	cdb_buffer_t *keys = malloc(LOAD_BATCH * sizeof *keys);
+	cdb_buffer_t *values = malloc(LOAD_BATCH * sizeof *values);
+	if (!b || !keys || !values)
 		goto fail;
-
-	for (;;) {
-		cdb_word_t klen = 0, vlen = 0;
-		char sep[2] = { 0, };
-		const int first = fgetc(input);
-		if (first == EOF) /* || first == '\n' {need to handle '\r' as well} */
-			goto end;
-		if (isspace(first))
-			continue;
-		if (first != '+')
-			goto fail;
-		if (scan(input, &klen, ',') < 0)
-			goto fail;
-		if (scan(input, &vlen, ':') < 0)
-			goto fail;
-		if (kmlen < klen) {
-			char *t = realloc(key, klen);
+	while (!eof) {
+		if (used == capacity) { /* a record bigger than our buffer */
+			char *t = (capacity * 2ul) > capacity ? realloc(b, capacity * 2ul) : NULL;
 			if (!t)
 				goto fail;
-			kmlen = klen;
-			key = t;
+			b = t;
+			capacity *= 2ul;
 		}
-
-		if (vmlen < vlen) {
-			char *t = realloc(value, vlen);
-			if (!t)
+		used += fread(b + used, 1, capacity - used, input);
+		if (used < capacity) {
+			if (ferror(input))
 				goto fail;
-			vmlen = vlen;
-			value = t;
+			eof = 1;
 		}
-
-		if (fread(key, 1, klen, input) != klen)
-			goto fail;
-
-		if (fread(sep, 1, sizeof sep, input) != sizeof sep)
-			goto fail;
-
-		if (sep[0] != '-' || sep[1] != '>')
-			goto fail;
-
-		if (fread(value, 1, vlen, input) != vlen)
-			goto fail;
-
-		const cdb_buffer_t kb = { .length = klen, .buffer = key };
-		const cdb_buffer_t vb = { .length = vlen, .buffer = value };
-
-		if (cdb_add(cdb, &kb, &vb) < 0) {
-			(void)fprintf(stderr, "cdb file add failed\n");
-			goto fail;
+		size_t start = 0, count = 0, next = 0;
+		for (int p = 0; (p = parse_record(b + start, used - start, eof, &keys[count], &values[count], &next)) != 0;) {
+			if (p < 0)
+				goto fail;
+			start += next;
+			if (++count == LOAD_BATCH) {
+				if (cdb_add_batch(cdb, keys, values, count) < 0)
+					goto fail;
+				count = 0;
+			}
 		}
-		const int ch1 = fgetc(input);
-		if (ch1 == '\n')
-			continue;
-		if (ch1 == EOF)
-			goto end;
-		if (ch1 != '\r')
-			goto fail;
-		if ('\n' != fgetc(input))
+		if (cdb_add_batch(cdb, keys, values, count) < 0)
 			goto fail;
+		memmove(b, b + start, used - start);
+		used -= start;
 	}
+	for (size_t i = 0; i < used; i++) /* only white space should be left */
+		if (!isspace((unsigned char)b[i]))
+			goto fail;
+	goto end;
 fail:
 	r = -1;
 end:
-	free(key);
-	free(value);
+	free(b);
+	free(keys);
+	free(values);
 	return r;
 }
 
@@ -368,8 +605,21 @@ static int cdb_stats(cdb_t *cdb, const cdb_file_pos_t *key, const cdb_file_pos_t
 	return 0;
 }
 
-static int cdb_stats_print(cdb_t *cdb, FILE *output, int verbose, size_t bytes) {
+static void cdb_stats_merge(cdb_statistics_t *to, const cdb_statistics_t *from) {
+	assert(to);
+	assert(from);
+	to->records            += from->records;
+	to->total_key_length   += from->total_key_length;
+	to->total_value_length += from->total_value_length;
+	to->min_key_length      = MIN(to->min_key_length,   from->min_key_length);
+	to->min_value_length    = MIN(to->min_value_length, from->min_value_length);
+	to->max_key_length      = MAX(to->max_key_length,   from->max_key_length);
+	to->max_value_length    = MAX(to->max_value_length, from->max_value_length);
+}
+
+static int cdb_stats_print(cdb_t *cdb, const cdb_options_t *ops, FILE *output, int verbose, size_t bytes) {
 	assert(cdb);
+	assert(ops);
 	assert(output);
 	unsigned long distances[DISTMAX] = { 0, };
 	unsigned long entries = 0, occupied = 0, collisions = 0, hmin = ULONG_MAX, hmax = 0;
@@ -380,8 +630,21 @@ static int cdb_stats_print(cdb_t *cdb, FILE *output, int verbose, size_t bytes)
 		.min_value_length = ULONG_MAX,
 	};
 
-	if (cdb_foreach(cdb, cdb_stats, &s) < 0)
+	if (ops->parallel && ops->threads > 1) { /* a range for each thread, each with their own statistics */
+		cdb_statistics_t *ss = malloc(ops->threads * sizeof *ss);
+		if (!ss)
+			return -1;
+		for (size_t i = 0; i < ops->threads; i++)
+			ss[i] = s;
+		const int r = foreach_parallel(cdb, ops, ops->threads, cdb_stats, ss, sizeof *ss, NULL);
+		for (size_t i = 0; i < ops->threads; i++)
+			cdb_stats_merge(&s, &ss[i]);
+		free(ss);
+		if (r < 0)
+			return -1;
+	} else if (cdb_foreach(cdb, cdb_stats, &s) < 0) {
 		return -1;
+	}
 
 	if (verbose)
 		if (fputs("Initial hash table:\n", output) < 0)
@@ -474,11 +737,132 @@ static int cdb_query(cdb_t *cdb, char *key, int record, FILE *output) {
 	const int gr = cdb_lookup(cdb, &kb, &vp, record);
 	if (gr < 0)
 		return -1;
+	sink_t out = { .output = output, }; /* no buffer of its own, "output" has one */
 	if (gr > 0) /* found */
-		return cdb_print(cdb, &vp, output) < 0 ? -1 : 0;
+		return cdb_print(cdb, &vp, &out) < 0 ? -1 : 0;
 	return 2; /* not found */
 }
 
+static int cdb_query_batch(cdb_t *cdb, const char *keys, const size_t *offsets, size_t count, unsigned depth, FILE *output) {
+	assert(cdb);
+	assert(keys);
+	assert(offsets);
+	assert(output);
+	assert(count <= QUERY_BATCH);
+	cdb_buffer_t kbs[QUERY_BATCH];
+	cdb_file_pos_t vps[QUERY_BATCH];
+	for (size_t i = 0; i < count; i++)
+		kbs[i] = (cdb_buffer_t) { .length = offsets[i + 1] - offsets[i], .buffer = (char*)keys + offsets[i], };
+	sink_t out = { .output = output, }; /* no buffer of its own, "output" has one */
+	const int found = depth ? cdb_host_lookup_async(cdb, kbs, vps, count, depth) : cdb_lookup_batch(cdb, kbs, vps, count);
+	if (found < 0)
+		return -1;
+	for (size_t i = 0; i < count; i++) {
+		if (vps[i].position == 0) /* not found */
+			continue;
+		if (fprintf(output, "+%lu,%lu:", (unsigned long)kbs[i].length, (unsigned long)vps[i].length) < 0)
+			return -1;
+		if (fwrite(kbs[i].buffer, 1, kbs[i].length, output) != kbs[i].length)
+			return -1;
+		if (fwrite("->", 1, 2, output) != 2)
+			return -1;
+		if (cdb_print(cdb, &vps[i], &out) < 0)
+			return -1;
+		if (fputc('\n', output) != '\n')
+			return -1;
+	}
+	return (size_t)found != count ? 2 : 0;
+}
+
+/* Queries are read in "+key-length:key" format and the key-value pairs
+ * found are printed out in the same format as a dump, keys not found are
+ * not printed. */
+static int cdb_queries(cdb_t *cdb, unsigned depth, FILE *input, FILE *output) {
+	assert(cdb);
+	assert(input);
+	assert(output);
+	int r = 0, missing = 0;
+	size_t kmlen = IO_BUFFER_SIZE, used = 0, count = 0;
+	size_t offsets[QUERY_BATCH + 1] = { 0, };
+	char *keys = malloc(kmlen);
+	if (!keys)
+		goto fail;
+	for (int eof = 0; !eof;) {
+		const int first = fgetc(input);
+		if (first == EOF) {
+			eof = 1;
+		} else if (isspace(first)) {
+			continue;
+		} else {
+			cdb_word_t klen = 0;
+			if (first != '+')
+				goto fail;
+			if (scan(input, &klen, ':') < 0)
+				goto fail;
+			if ((used + klen) < used)
+				goto fail;
+			if (kmlen < (used + klen)) {
+				char *t = realloc(keys, used + klen);
+				if (!t)
+					goto fail;
+				kmlen = used + klen;
+				keys = t;
+			}
+			if (fread(keys + used, 1, klen, input) != klen)
+				goto fail;
+			used += klen;
+			offsets[++count] = used;
+			const int ch1 = fgetc(input);
+			if (ch1 == EOF)
+				eof = 1;
+			else if (ch1 == '\r' && fgetc(input) != '\n')
+				goto fail;
+			else if (ch1 != '\n' && ch1 != '\r')
+				goto fail;
+		}
+		if (count == QUERY_BATCH || (eof && count)) {
+			const int q = cdb_query_batch(cdb, keys, offsets, count, depth, output);
+			if (q < 0)
+				goto fail;
+			missing |= q;
+			count = 0;
+			used = 0;
+		}
+	}
+	goto end;
+fail:
+	r = -1;
+end:
+	free(keys);
+	return r < 0 ? r : missing;
+}
+
+/* The databases are opened by the server, so it can open them again when
+ * they are replaced */
+static int serve(const cdb_options_t *ops, const char *address, char **files, int count) {
+	assert(ops);
+	assert(address);
+	assert(files);
+	cdb_host_reload_t **dbs = calloc(count, sizeof (*dbs));
+	const unsigned readers = ops->threads ? ops->threads : 1u;
+	int r = -1, opened = 0;
+	if (!dbs)
+		return -1;
+	for (; opened < count; opened++)
+		if (cdb_host_reload_open(&dbs[opened], ops, files[opened], readers) < 0) {
+			info("opening '%s' failed", files[opened]);
+			goto done;
+		}
+	info("serving %d database(s) on '%s'", count, address);
+	r = cdb_host_serve(dbs, count, address, readers);
+done:
+	for (int i = 0; i < opened; i++)
+		if (cdb_host_reload_close(dbs[i]) < 0)
+			r = -1;
+	free(dbs);
+	return r;
+}
+
 /* We should output directly to a database as well... */
 static int generate(FILE *output, unsigned long records, unsigned long min, unsigned long max, unsigned long seed) {
 	assert(output);
@@ -508,15 +892,17 @@ static int generate(FILE *output, unsigned long records, unsigned long min, unsi
 	return 0;
 }
 
-static int hasher(FILE *input, FILE *output) { /* should really input keys in "+length:key\n" format */
+static int hasher(FILE *input, FILE *output, const cdb_hash_info_t *hash) { /* should really input keys in "+length:key\n" format */
 	assert(input);
 	assert(output);
+	assert(hash);
+	const int width = (int)MIN(hash->bits, sizeof (cdb_word_t) * CHAR_BIT) / 4;
 	char line[512] = { 0, }; /* long enough for everyone right? */
 	for (; fgets(line, sizeof line, input); line[0] = 0) {
 		size_t l = strlen(line);
 		if (l && line[l-1] == '\n')
 			line[l--] = 0;
-		if (fprintf(output, "0x%08lx\n", (unsigned long)cdb_hash((uint8_t*)line, l)) < 0)
+		if (fprintf(output, "0x%0*llx\n", width, (unsigned long long)hash->hash((uint8_t*)line, l)) < 0)
 			return -1;
 	}
 	return 0;
@@ -533,7 +919,7 @@ static int help(FILE *output, const char *arg0) {
 	const unsigned y = (version >>  8) & 0xff;
 	const unsigned z = (version >>  0) & 0xff;
 	static const char *usage = "\
-Usage   : %s -hv *OR* -[rcdkstVT] file.cdb *OR* -q file.cdb key [record#] *OR* -g *OR* -H\n\
+Usage   : %s -hviIZ -a hash *OR* -[rcdkstVTQ] file.cdb *OR* -q file.cdb key [record#] *OR* -l address file.cdb... *OR* -g *OR* -H\n\
 Program : Constant Database Driver (clone of https://cr.yp.to/cdb.html)\n\
 Author  : " CDB_AUTHOR "\n\
 Email   : " CDB_EMAIL "\n\
@@ -545,7 +931,10 @@ Size    : %d\n\
 Notes   : See manual pages or project website for more information.\n\n\
 Options :\n\n\
 \t-h          : print this help message and exit successfully\n\
-\t-v          : increase verbosity level\n\
+\t-v          : increase verbosity level, counters are printed if the library keeps them\n\
+\t-i          : keep the initial hash table in memory when reading\n\
+\t-I          : keep all of the hash tables in memory when reading\n\
+\t-Z          : memory map the database when reading (zero copy)\n\
 \t-c file.cdb : create a new database reading keys from stdin\n\
 \t-d file.cdb : dump entire database\n\
 \t-k file.cdb : dump all keys (there may be duplicates)\n\
@@ -554,9 +943,19 @@ Options :\n\n\
 \t-T temp.cdb : name of temporary file to use\n\
 \t-V file.cdb : validate database\n\
 \t-q file.cdb key #? : run query for key with optional record number\n\
+\t-Q file.cdb : run queries read from stdin, printing the records found\n\
 \t-b size     : database size (valid sizes = 16, 32 (default), 64)\n\
 \t-o number   : specify offset into file where database begins\n\
+\t-B number   : size of write buffer used when creating, 0 disables it\n\
+\t-j number   : number of threads to use when creating, dumping, validating or for stats\n\
+\t-e number   : rough limit in bytes on hash table memory when creating, 0 for none\n\
+\t-C number   : number of entries in a cache of keys found when reading, 0 for none\n\
+\t-F number   : bits per key of a filter of the keys made when creating, 0 for none\n\
+\t-A number   : number of lookups going at once for -Q, reads are queued with io_uring if possible\n\
+\t-w number   : read in the hash tables (1) or the whole database (2) in the background, 0 for neither\n\
+\t-l address  : serve the databases named after the options to memcached clients, see below\n\
 \t-H          : hash keys and output their hash\n\
+\t-a name     : select hash (djb (default), djb64, sdbm64, xxh64, murmur64a)\n\
 \t-g          : spit out an example database *dump* to standard out\n\
 \t-m number   : set minimum length of generated record\n\
 \t-M number   : set maximum length of generated record\n\
@@ -566,8 +965,13 @@ In create mode the key input format is:\n\n\
 \t+key-length,value-length:key->value\n\n\
 An example:\n\n\
 \t+5,5:hello->world\n\n\
-Queries are in a similar format:\n\n\
+Queries (for -Q) are in a similar format:\n\n\
 \t+key-length:key\n\n\
+The address for -l is a path for a Unix socket, \"[host:]port\" for TCP or\n\
+\"-\" for standard input and output, -j sets the number of worker threads.\n\
+Only \"get\" and \"gets\" work (in the text or binary protocol), a key is\n\
+looked for in each database in turn. A database renamed into place (as -T\n\
+does) is swapped for the new one while serving.\n\n\
 Binary key/values are allowed, as are duplicate and empty keys/values.\n\
 Returns values of 0 indicate success/found, 2 not found, and anything else\n\
 indicates an error.\n\
@@ -576,37 +980,45 @@ indicates an error.\n\
 }
 
 int main(int argc, char **argv) {
-	enum { QUERY, DUMP, CREATE, STATS, KEYS, VALIDATE, GENERATE, };
+	enum { QUERY, QUERIES, DUMP, CREATE, STATS, KEYS, VALIDATE, GENERATE, HASH, SERVE, };
 	const char *file = NULL;
 	char *tmp = NULL;
 	int mode = VALIDATE, creating = 0;
 	unsigned long min = 0ul, max = 1024ul, records = 1024ul, seed = 0ul;
+	unsigned depth = 0; /* lookups at once for QUERIES, zero uses "cdb_lookup_batch" instead */
+	const char *address = NULL; /* to SERVE on */
 
 	binary(stdin);
 	binary(stdout);
 	binary(stderr);
 
-	char ibuf[BUFSIZ], obuf[BUFSIZ]; /* NOT INITIALIZED */
+	static char ibuf[IO_STREAM_SIZE], obuf[IO_STREAM_SIZE]; /* large buffers make dumping and loading faster */
 	if (setvbuf(stdin, ibuf, _IOFBF, sizeof ibuf) < 0)
 		return -1;
 	if (setvbuf(stdout, obuf, _IOFBF, sizeof obuf) < 0)
 		return -1;
 
 	cdb_options_t ops = cdb_host_options;
+	const cdb_hash_info_t *hash = cdb_hash_info(CDB_HASH_DJB);
 
 	cdb_getopt_t opt = { .init = 0 };
-	for (int ch = 0; (ch = cdb_getopt(&opt, argc, argv, "hHgvt:c:d:k:s:q:V:b:T:m:M:R:S:o:")) != -1; ) {
+	for (int ch = 0; (ch = cdb_getopt(&opt, argc, argv, "hHgviIZt:c:d:k:s:q:Q:V:b:T:m:M:R:S:o:a:B:j:e:C:F:A:l:w:")) != -1; ) {
 		switch (ch) {
 		case 'h': return help(stdout, argv[0]), 0;
-		case 'H': return hasher(stdin, stdout);
+		case 'H': mode = HASH;                     break;
 		case 't': return -cdb_tests(&ops, opt.arg);
 		case 'v': verbose++;                       break;
+		case 'i': ops.flags |= CDB_OPTION_INDEX;   break;
+		case 'I': ops.flags |= CDB_OPTION_TABLES;  break;
+		case 'Z': ops.map = cdb_mmap_options.map;  break;
 		case 'c': file = opt.arg; mode = CREATE;   break;
 		case 'd': file = opt.arg; mode = DUMP;     break;
 		case 'k': file = opt.arg; mode = KEYS;     break;
 		case 's': file = opt.arg; mode = STATS;    break;
 		case 'q': file = opt.arg; mode = QUERY;    break;
+		case 'Q': file = opt.arg; mode = QUERIES;  break;
 		case 'V': file = opt.arg; mode = VALIDATE; break;
+		case 'l': address = opt.arg; mode = SERVE; break;
 		case 'g': mode = GENERATE;                 break;
 		case 'T': assert(opt.arg); tmp  = opt.arg; break;
 		case 'b': assert(opt.arg); ops.size   = atol(opt.arg); break;
@@ -615,10 +1027,32 @@ int main(int argc, char **argv) {
 		case 'R': assert(opt.arg); records    = atol(opt.arg); break;
 		case 'S': assert(opt.arg); seed       = atol(opt.arg); break;
 		case 'o': assert(opt.arg); ops.offset = atol(opt.arg); break;
+		case 'B': assert(opt.arg); ops.buffer = atol(opt.arg); break;
+		case 'j': assert(opt.arg); ops.threads = atol(opt.arg); break;
+		case 'e': assert(opt.arg); ops.memory = atol(opt.arg); break;
+		case 'C': assert(opt.arg); ops.cache = atol(opt.arg); break;
+		case 'F': assert(opt.arg); ops.filter = atol(opt.arg); break;
+		case 'A': assert(opt.arg); depth      = atol(opt.arg); break;
+		case 'w': assert(opt.arg); /* set now so it reaches -t, the last one given wins */
+			ops.flags &= ~(CDB_OPTION_WARM | CDB_OPTION_WARM_ALL);
+			ops.flags |= atol(opt.arg) > 1 ? CDB_OPTION_WARM_ALL : atol(opt.arg) ? CDB_OPTION_WARM : 0;
+			break;
+		case 'a': assert(opt.arg);
+			if (!(hash = cdb_hash_find(opt.arg)))
+				die("unknown hash '%s'", opt.arg);
+			ops.hash = hash->hash;
+			break;
 		default: help(stderr, argv[0]); return 1;
 		}
 	}
 
+	if (mode == HASH) {
+		int r = hasher(stdin, stdout, hash);
+		if (fflush(stdout) < 0)
+			r = -1;
+		return r < 0 ? 1 : 0;
+	}
+
 	/* N.B. We could also generate a CDB file directly as well,
 	 * instead of generating a dump, the "generate" function
 	 * would need a rewrite though */
@@ -633,6 +1067,9 @@ int main(int argc, char **argv) {
 		return r < 0 ? 1 : 0;
 	}
 
+	if (mode == SERVE && opt.index < argc)
+		file = argv[opt.index];
+
 	/* For many of the modes "file" could be "stdout", this works
 	 * for everything bar CREATE mode which will need to seek on
 	 * its output. */
@@ -641,6 +1078,31 @@ int main(int argc, char **argv) {
 
 	creating = mode == CREATE;
 
+	char *filters[2] = { NULL, NULL, }; /* filters of "file" and "tmp" */
+	for (size_t i = 0; i < 2; i++) {
+		const char *f = i ? tmp : file;
+		const size_t l = f ? strlen(f) : 0;
+		if (!f)
+			continue;
+		if (!(filters[i] = malloc(l + sizeof (FILTER_EXT))))
+			die("allocation failed");
+		memcpy(filters[i], f, l);
+		memcpy(filters[i] + l, FILTER_EXT, sizeof (FILTER_EXT));
+	}
+	if (creating && !ops.filter) /* an old filter would no longer match */
+		(void)remove(filters[0]);
+	if (!creating) /* use the filter made with the database, if there is one */
+		ops.filter = ops.filter ? ops.filter : 1;
+	if (mode == QUERY || mode == QUERIES || mode == SERVE) /* records are only looked up, reading ahead is wasted */
+		ops.flags |= CDB_OPTION_RANDOM;
+
+	if (mode == SERVE) {
+		const int r = serve(&ops, address, argv + opt.index, argc - opt.index);
+		free(filters[0]);
+		free(filters[1]);
+		return r < 0 ? 1 : 0;
+	}
+
 	cdb_t *cdb = NULL;
 	const char *name = creating && tmp ? tmp : file;
 	info("opening '%s' for %s", name, creating ? "writing" : "reading");
@@ -652,14 +1114,18 @@ int main(int argc, char **argv) {
 		die("opening file '%s' in %s mode failed: %s", name, m, f);
 	}
 	errno = etmp;
+	if (!creating)
+		warm_print(cdb);
 
 	int r = 0;
 	switch (mode) {
 	case CREATE:   r = cdb_create(cdb, stdin);                                                       break;
-	case DUMP:     r = cdb_foreach(cdb, cdb_dump,      stdout); if (fputc('\n', stdout) < 0) r = -1; break;
-	case KEYS:     r = cdb_foreach(cdb, cdb_dump_keys, stdout); if (fputc('\n', stdout) < 0) r = -1; break;
-	case STATS:    r = cdb_stats_print(cdb, stdout, 0, ops.size / 8ul);                              break;
-	case VALIDATE: r = cdb_foreach(cdb, NULL, NULL);                                                 break;
+	case DUMP:     r = dump(cdb, &ops, cdb_dump);                                                    break;
+	case KEYS:     r = dump(cdb, &ops, cdb_dump_keys);                                               break;
+	case STATS:    r = cdb_stats_print(cdb, &ops, stdout, 0, ops.size / 8ul);                        break;
+	case VALIDATE: r = ops.parallel && ops.threads > 1 ?
+			foreach_parallel(cdb, &ops, ops.threads, NULL, NULL, 0, NULL) : cdb_foreach(cdb, NULL, NULL); break;
+	case QUERIES:  r = cdb_queries(cdb, depth, stdin, stdout);                                       break;
 	case QUERY: {
 		if (opt.index >= argc)
 			die("-q opt requires key (and optional record number)");
@@ -673,6 +1139,17 @@ int main(int argc, char **argv) {
 	if (fflush(stdout) < 0)
 		r = -1;
 
+	if (ops.cache && !creating) {
+		uint64_t hits = 0, misses = 0;
+		(void)cdb_cache_counts(cdb, &hits, &misses);
+		info("cache hits %lu, misses %lu", (unsigned long)hits, (unsigned long)misses);
+	}
+	cdb_stats_t stats;
+	if (verbose && !creating && cdb_stats_get(cdb, &stats) > 0)
+		stats_print(&stats);
+	if (!creating)
+		warm_print(cdb);
+
 	const int cdbe = cdb_status(cdb);
 	if (cdb_close(cdb) < 0)
 		die("close failed: %d", cdbe);
@@ -681,9 +1158,15 @@ int main(int argc, char **argv) {
 
 	if (creating && tmp) {
 		info("renaming temporary file");
+		/* filter first, a reader opening the old database in between
+		 * only sees a filter that does not match it and ignores it */
+		if (ops.filter && rename(filters[1], filters[0]) < 0)
+			die("rename from '%s' to '%s' failed: %s", filters[1], filters[0], strerror(errno));
 		if (rename(tmp, file) < 0)
 			die("rename from '%s' to '%s' failed: %s", tmp, file, strerror(errno));
 	}
+	free(filters[0]);
+	free(filters[1]);
 	return r < 0 ? 1 : r; /* 2 might be returned for not found */
 }
 